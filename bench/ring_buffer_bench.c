@@ -0,0 +1,136 @@
+/*
+ * Microbenchmark of the UART ring buffer against the previous implementation, which wrapped its int indices with %
+ * and moved one byte per call.
+ *
+ * Usage: ring_buffer_bench [MEGABYTES]
+ *
+ * Each case pushes the given amount of data (default 64 MiB) through a 256 byte ring in chunks the size of a typical
+ * AT command and prints the time per byte. The checksum line guards against the compiler dropping the work.
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "ring_buffer.h"
+
+#define RING_SIZE 256
+#define CHUNK 48
+
+/////////////////////////////////////////////////////
+//             PREVIOUS IMPLEMENTATION             //
+/////////////////////////////////////////////////////
+
+typedef struct  {
+    int head;
+    int tail;
+    int size;
+    uint8_t *buffer;
+} legacy_ring_buffer;
+
+static bool legacy_full(legacy_ring_buffer *rb) {
+    return (rb->head + 1) % rb->size == rb->tail;
+}
+
+static bool legacy_empty(legacy_ring_buffer *rb) {
+    return rb->head == rb->tail;
+}
+
+static bool legacy_put(legacy_ring_buffer *rb, uint8_t data) {
+    int nh = (rb->head + 1) % rb->size;
+    if (nh == rb->tail) return false;
+    rb->buffer[rb->head] = data;
+    rb->head = nh;
+    return true;
+}
+
+static uint8_t legacy_get(legacy_ring_buffer *rb) {
+    uint8_t value = rb->buffer[rb->tail];
+    rb->tail = (rb->tail + 1) % rb->size;
+    return value;
+}
+
+/////////////////////////////////////////////////////
+//                   BENCHMARKS                    //
+/////////////////////////////////////////////////////
+
+static volatile int ring_size = RING_SIZE; // keeps the compiler from turning the legacy % into a mask
+static uint8_t source[CHUNK];
+static uint8_t sink[CHUNK];
+static uint32_t checksum;
+
+static double now_s(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+/* The loops of uart_write() and uart_read() before the change. */
+static void run_legacy(size_t chunks) {
+    static uint8_t storage[RING_SIZE];
+    legacy_ring_buffer rb = {0, 0, ring_size, storage};
+    for (size_t c = 0; c < chunks; c++) {
+        int count = 0;
+        const uint8_t *in = source;
+        while (count < CHUNK && !legacy_full(&rb)) {
+            legacy_put(&rb, *in++);
+            ++count;
+        }
+        uint8_t *out = sink;
+        count = 0;
+        while (count < CHUNK && !legacy_empty(&rb)) {
+            *out++ = legacy_get(&rb);
+            ++count;
+        }
+        checksum += sink[c % CHUNK];
+    }
+}
+
+static void run_bytewise(size_t chunks) {
+    static uint8_t storage[RING_SIZE];
+    ring_buffer rb;
+    rb_init(&rb, storage, RING_SIZE);
+    for (size_t c = 0; c < chunks; c++) {
+        for (int i = 0; i < CHUNK; i++) {
+            rb_put(&rb, source[i]);
+        }
+        for (int i = 0; i < CHUNK && !rb_empty(&rb); i++) {
+            sink[i] = rb_get(&rb);
+        }
+        checksum += sink[c % CHUNK];
+    }
+}
+
+static void run_span(size_t chunks) {
+    static uint8_t storage[RING_SIZE];
+    ring_buffer rb;
+    rb_init(&rb, storage, RING_SIZE);
+    for (size_t c = 0; c < chunks; c++) {
+        rb_put_span(&rb, source, CHUNK);
+        rb_get_span(&rb, sink, CHUNK);
+        checksum += sink[c % CHUNK];
+    }
+}
+
+static void measure(const char *name, void (*run)(size_t), size_t bytes) {
+    size_t chunks = bytes / CHUNK;
+    run(chunks / 16); // warm up
+    double start = now_s();
+    run(chunks);
+    double elapsed = now_s() - start;
+    printf("%-28s %8.3f ns/byte %10.1f MB/s\n", name, elapsed * 1e9 / (double) (chunks * CHUNK),
+           (double) (chunks * CHUNK) / elapsed / 1e6);
+}
+
+int main(int argc, char **argv) {
+    size_t megabytes = argc > 1 ? strtoul(argv[1], NULL, 0) : 64;
+    for (int i = 0; i < CHUNK; i++) {
+        source[i] = (uint8_t) (i * 7 + 1);
+    }
+
+    measure("previous, byte at a time", run_legacy, megabytes << 20);
+    measure("rb_put/rb_get", run_bytewise, megabytes << 20);
+    measure("rb_put_span/rb_get_span", run_span, megabytes << 20);
+    printf("checksum %u\n", checksum);
+    return 0;
+}
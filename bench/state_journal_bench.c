@@ -0,0 +1,195 @@
+/*
+ * Counts the EEPROM writes and bytes that persisting DeviceState costs per dispensing cycle, with the previous
+ * fixed-address write_to_eeprom() and with the journal in state.c.
+ *
+ * Usage: state_journal_bench [CYCLES]
+ *
+ * state.c runs unchanged against an in-memory 24LC256 that counts the writes to every cell. Each cycle replays the
+ * write_to_eeprom() calls main.c makes from boot to the end of a week of dispensing. The busiest cell decides the
+ * lifetime, as the 24LC256 is rated for 1,000,000 writes per cell.
+ */
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hardware/i2c.h"
+#include "pico/stdlib.h"
+#include "state.h"
+
+#define COMPARTMENTS 8
+#define ENDURANCE 1000000.0
+#define DEVADDR 0x50
+
+/////////////////////////////////////////////////////
+//                 IN-MEMORY EEPROM                //
+/////////////////////////////////////////////////////
+
+struct i2c_inst {
+    uint baudrate;
+};
+i2c_inst_t sim_i2c0_inst;
+
+static uint8_t memory[I2C_MEMORY_SIZE];
+static uint32_t cell_writes[I2C_MEMORY_SIZE];
+static uint64_t bytes_written;
+static uint64_t write_cycles;
+static uint16_t address_pointer;
+static uint64_t now_us;
+
+uint i2c_init(i2c_inst_t *i2c, uint baudrate) {
+    return baudrate;
+}
+
+uint i2c_set_baudrate(i2c_inst_t *i2c, uint baudrate) {
+    return baudrate;
+}
+
+/* The bus never hangs here, so the recovery in state.c has nothing to clock. */
+void gpio_set_function(uint gpio, enum gpio_function fn) {
+}
+
+void gpio_set_dir(uint gpio, bool out) {
+}
+
+void gpio_put(uint gpio, bool value) {
+}
+
+bool gpio_get(uint gpio) {
+    return true;
+}
+
+void gpio_pull_up(uint gpio) {
+}
+
+void sleep_us(uint64_t us) {
+    now_us += us;
+}
+
+uint64_t time_us_64(void) {
+    return now_us += 100;
+}
+
+int i2c_write_blocking(i2c_inst_t *i2c, uint8_t addr, const uint8_t *src, size_t len, bool nostop) {
+    if (len >= 2) {
+        address_pointer = (uint16_t) ((src[0] << 8 | src[1]) & (I2C_MEMORY_SIZE - 1));
+    }
+    if (len > 2) {
+        write_cycles++;
+    }
+    for (size_t i = 2; i < len; i++) {
+        uint16_t page = address_pointer & ~(I2C_MEM_PAGE_SIZE - 1);
+        uint16_t address = page | ((address_pointer + i - 2) & (I2C_MEM_PAGE_SIZE - 1));
+        memory[address] = src[i];
+        cell_writes[address]++;
+        bytes_written++;
+    }
+    return (int) len;
+}
+
+int i2c_read_blocking(i2c_inst_t *i2c, uint8_t addr, uint8_t *dst, size_t len, bool nostop) {
+    for (size_t i = 0; i < len; i++) {
+        dst[i] = memory[address_pointer];
+        address_pointer = (address_pointer + 1) & (I2C_MEMORY_SIZE - 1);
+    }
+    return (int) len;
+}
+
+int i2c_write_timeout_us(i2c_inst_t *i2c, uint8_t addr, const uint8_t *src, size_t len, bool nostop, uint timeout_us) {
+    return i2c_write_blocking(i2c, addr, src, len, nostop);
+}
+
+int i2c_read_timeout_us(i2c_inst_t *i2c, uint8_t addr, uint8_t *dst, size_t len, bool nostop, uint timeout_us) {
+    return i2c_read_blocking(i2c, addr, dst, len, nostop);
+}
+
+/////////////////////////////////////////////////////
+//                   BENCHMARKS                    //
+/////////////////////////////////////////////////////
+
+/* write_to_eeprom() before the journal: every state went to the last bytes of the memory, all of it in page writes of
+ * its own. It goes to the bus directly, as the page cache of state.c would leave out the bytes that did not change. */
+static bool legacy_write_to_eeprom(const DeviceState *state) {
+    DeviceState stateToWrite = *state;
+    stateToWrite.crc16 = crc16((uint8_t *) &stateToWrite, offsetof(DeviceState, crc16));
+
+    const uint8_t *src = (const uint8_t *) &stateToWrite;
+    uint16_t address = I2C_MEMORY_SIZE - sizeof(stateToWrite);
+    size_t left = sizeof(stateToWrite);
+    while (left > 0) {
+        size_t len = I2C_MEM_PAGE_SIZE - (address & (I2C_MEM_PAGE_SIZE - 1));
+        if (len > left) {
+            len = left;
+        }
+        uint8_t buffer[2 + I2C_MEM_PAGE_SIZE];
+        buffer[0] = (uint8_t) (address >> 8);
+        buffer[1] = (uint8_t) address;
+        memcpy(buffer + 2, src, len);
+        if ((int) (len + 2) != i2c_write_blocking(i2c0, DEVADDR, buffer, len + 2, false)) {
+            return false;
+        }
+        address += len;
+        src += len;
+        left -= len;
+    }
+    return true;
+}
+
+static bool (*persist)(const DeviceState *);
+
+/* The state writes of main.c from a clean boot through calibration and a full week to resetValues(). */
+static void run_cycle(void) {
+    DeviceState machine = {0};
+
+    persist(&machine);                // "Clean boot."
+    persist(&machine);                // "Waiting for button to calibrate."
+    machine.currentState = DISPENSE_WAITING;
+    machine.compartmentFinished = FINISHED;
+    persist(&machine);                // "Calibrated."
+    for (machine.compartmentsMoved = 1; machine.compartmentsMoved < COMPARTMENTS; machine.compartmentsMoved++) {
+        machine.compartmentFinished = IN_THE_MIDDLE;
+        persist(&machine);            // first step of the turn
+        machine.compartmentFinished = FINISHED;
+        persist(&machine);            // turn finished
+        persist(&machine);            // "Day N: ..."
+    }
+    persist(&machine);                // "All pills dispensed."
+    memset(&machine, 0, sizeof(machine));
+    persist(&machine);                // resetValues()
+}
+
+static void measure(const char *name, bool (*write)(const DeviceState *), unsigned cycles) {
+    memset(memory, 0xff, sizeof(memory));
+    memset(cell_writes, 0, sizeof(cell_writes));
+    persist = write;
+    write_cycles = 0;
+    bytes_written = 0;
+    for (unsigned c = 0; c < cycles; c++) {
+        run_cycle();
+    }
+    uint32_t busiest = 0;
+    for (size_t i = 0; i < I2C_MEMORY_SIZE; i++) {
+        if (cell_writes[i] > busiest) {
+            busiest = cell_writes[i];
+        }
+    }
+    double per_cycle = (double) busiest / cycles;
+    printf("%-16s %5.1f write cycles/cycle %6.1f bytes/cycle %6.2f writes/cycle to the busiest cell "
+           "%8.0f weekly cycles to wear-out\n", name, (double) write_cycles / cycles, (double) bytes_written / cycles,
+           per_cycle, ENDURANCE / per_cycle);
+}
+
+int main(int argc, char **argv) {
+    unsigned cycles = argc > 1 ? (unsigned) strtoul(argv[1], NULL, 0) : 1000;
+
+    eepromInit();
+    measure("fixed address", legacy_write_to_eeprom, cycles);
+    measure("journal", write_to_eeprom, cycles);
+
+    DeviceState state;
+    if (!read_from_eeprom(&state) || 0 != state.compartmentsMoved) {
+        printf("journal did not return the last state\n");
+        return 1;
+    }
+    return 0;
+}
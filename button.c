@@ -3,15 +3,103 @@
 //
 #include "button.h"
 #include "hardware/gpio.h"
+#include "pico/time.h"
 
 //GLOBAL VARIABLES
-static const int button_arr[] = {SW_0, SW_2};
+static const struct {
+    uint gpio;
+    bool released;              // level of the pin while the button is up
+} button_arr[] = {{SW_0, SW0_RELEASED}, {SW_2, SW2_RELEASED}};
+
+#define BUTTON_COUNT (sizeof(button_arr)/sizeof(button_arr[0]))
+
+// Debounce by time stamps: the first edge after a quiet BUTTON_DEBOUNCE counts at once and the edges right after it
+// are bounces. The settle alarm reads the pin once the bounces are over, in case the last one left it changed.
+static struct {
+    bool pressed;
+    bool long_reported;
+    bool double_reported;
+    uint64_t changed_us;        // when pressed last changed
+    uint64_t pressed_us;        // when the button last went down
+    alarm_id_t settle_alarm;    // 0 or less while none is pending
+    alarm_id_t long_alarm;
+} buttons[BUTTON_COUNT];
+
+static button_callback_t button_callback;
 
 //BUTTON FUNCTIONS
-void buttonsInit() {
-    for (int i = 0; i < sizeof(button_arr)/sizeof(button_arr[0]); i++) {
-        gpio_init(button_arr[i]);
-        gpio_set_dir(button_arr[i], GPIO_IN);
-        gpio_pull_up(button_arr[i]);
+void buttonsInit(button_callback_t callback) {
+    button_callback = callback;
+    for (int i = 0; i < BUTTON_COUNT; i++) {
+        gpio_init(button_arr[i].gpio);
+        gpio_set_dir(button_arr[i].gpio, GPIO_IN);
+        gpio_pull_up(button_arr[i].gpio);
+        buttons[i].pressed = button_arr[i].released != gpio_get(button_arr[i].gpio);
+        gpio_set_irq_enabled(button_arr[i].gpio, GPIO_IRQ_EDGE_FALL | GPIO_IRQ_EDGE_RISE, true);
+    }
+}
+
+static int64_t buttonLong(alarm_id_t id, void *user_data) {
+    int i = (int) (uintptr_t) user_data;
+    buttons[i].long_alarm = 0;
+    buttons[i].long_reported = true;
+    button_callback(button_arr[i].gpio, BUTTON_LONG_PRESS);
+    return 0;
+}
+
+// Takes the new position of button i and reports what it means.
+static void buttonChanged(int i, bool pressed, uint64_t now) {
+    buttons[i].pressed = pressed;
+    buttons[i].changed_us = now;
+    if (true == pressed) {
+        bool twice = 0 != buttons[i].pressed_us && false == buttons[i].double_reported &&
+                     now - buttons[i].pressed_us <= BUTTON_DOUBLE * 1000ull;
+        buttons[i].pressed_us = now;
+        buttons[i].long_reported = false;
+        buttons[i].double_reported = twice;
+        button_callback(button_arr[i].gpio, BUTTON_PRESS);
+        if (true == twice) {
+            button_callback(button_arr[i].gpio, BUTTON_DOUBLE_PRESS);
+        }
+        buttons[i].long_alarm = add_alarm_in_ms(BUTTON_LONG, buttonLong, (void *) (uintptr_t) i, true);
+    } else {
+        if (0 < buttons[i].long_alarm) {
+            cancel_alarm(buttons[i].long_alarm);
+            buttons[i].long_alarm = 0;
+        }
+        if (false == buttons[i].long_reported) {
+            button_callback(button_arr[i].gpio, BUTTON_SHORT_PRESS);
+        }
+    }
+}
+
+static int64_t buttonSettle(alarm_id_t id, void *user_data) {
+    int i = (int) (uintptr_t) user_data;
+    buttons[i].settle_alarm = 0;
+    bool pressed = button_arr[i].released != gpio_get(button_arr[i].gpio);
+    if (pressed != buttons[i].pressed) {
+        buttonChanged(i, pressed, time_us_64());
+    }
+    return 0;
+}
+
+// Called from the GPIO interrupt handler for every edge. Returns false if gpio is not a button.
+bool buttonEdge(uint gpio, uint32_t event_mask) {
+    for (int i = 0; i < BUTTON_COUNT; i++) {
+        if (button_arr[i].gpio != gpio) {
+            continue;
+        }
+        uint64_t now = time_us_64();
+        bool pressed = button_arr[i].released != gpio_get(gpio);
+        if (now - buttons[i].changed_us < BUTTON_DEBOUNCE * 1000ull) {
+            if (0 >= buttons[i].settle_alarm) {
+                buttons[i].settle_alarm = add_alarm_in_us(buttons[i].changed_us + BUTTON_DEBOUNCE * 1000ull - now,
+                                                          buttonSettle, (void *) (uintptr_t) i, true);
+            }
+        } else if (pressed != buttons[i].pressed) {
+            buttonChanged(i, pressed, now);
+        }
+        return true;
     }
+    return false;
 }
\ No newline at end of file
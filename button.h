@@ -1,13 +1,29 @@
 #ifndef BUTTON
 #define BUTTON
 
+#include "pico.h"
+
 #define SW_0 9
 #define SW_2 7
-#define BUTTON_PERIOD 10 // Button sampling timer period in ms
-#define BUTTON_FILTER 5
 #define SW0_RELEASED 1
 #define SW2_RELEASED 1
 
-void buttonsInit();
+/*   Press detection, from the edge interrupts of the buttons   */
+#define BUTTON_DEBOUNCE 20      // ms after an accepted edge during which the contacts may still bounce
+#define BUTTON_LONG 1000        // ms a button is held for a long press
+#define BUTTON_DOUBLE 400       // ms from one press to the next for a double press
+
+enum ButtonEvent {
+    BUTTON_PRESS,               // the button went down, reported at once
+    BUTTON_SHORT_PRESS,         // released before BUTTON_LONG
+    BUTTON_LONG_PRESS,          // held for BUTTON_LONG, reported while still held
+    BUTTON_DOUBLE_PRESS         // pressed again within BUTTON_DOUBLE, reported after its BUTTON_PRESS
+};
+
+// Receives the presses of the button on gpio. Runs in the GPIO or timer interrupt.
+typedef void (*button_callback_t)(uint gpio, enum ButtonEvent event);
+
+void buttonsInit(button_callback_t callback);
+bool buttonEdge(uint gpio, uint32_t event_mask);
 
 #endif
\ No newline at end of file
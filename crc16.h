@@ -0,0 +1,50 @@
+#ifndef CRC16_H
+#define CRC16_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * CRC-16/CCITT-FALSE (polynomial 0x1021, initial value 0xFFFF, no reflection), as used for the EEPROM records. The
+ * CRC of data followed by its CRC in big endian is 0.
+ *
+ * CRC16_VARIANT picks the implementation behind crc16() and crc16_update(), trading flash for speed:
+ *   CRC16_BITWISE  no table, a few shifts and XORs per byte
+ *   CRC16_TABLE    one 256 entry table (512 bytes), one lookup per byte
+ *   CRC16_SLICE4   four tables (2 KiB), four bytes per step; only pays off for long buffers
+ */
+#define CRC16_BITWISE 0
+#define CRC16_TABLE 1
+#define CRC16_SLICE4 4
+
+#ifndef CRC16_VARIANT
+#define CRC16_VARIANT CRC16_TABLE
+#endif
+
+#define CRC16_INIT 0xFFFF
+
+uint16_t crc16(const uint8_t *data, size_t length);
+
+/*
+ * Incremental use for data that arrives in pieces:
+ *
+ *     uint16_t crc = crc16_init();
+ *     crc = crc16_update(crc, piece, length);    // once per piece, in order
+ *     ... crc16_final(crc) equals crc16() over all pieces at once
+ */
+static inline uint16_t crc16_init(void) {
+    return CRC16_INIT;
+}
+
+uint16_t crc16_update(uint16_t crc, const uint8_t *data, size_t length);
+
+static inline uint16_t crc16_final(uint16_t crc) {
+    return crc;
+}
+
+/* The variants of crc16_update(). Only the selected one is built, unless CRC16_ALL_VARIANTS is defined. */
+uint16_t crc16UpdateBitwise(uint16_t crc, const uint8_t *data, size_t length);
+uint16_t crc16UpdateTable(uint16_t crc, const uint8_t *data, size_t length);
+uint16_t crc16UpdateSlice4(uint16_t crc, const uint8_t *data, size_t length);
+
+#endif
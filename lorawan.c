@@ -1,4 +1,5 @@
 
+#include <stdatomic.h>
 #include <stdio.h>
 #include <string.h>
 #include "pico/time.h"
@@ -14,6 +15,8 @@
 #endif
 
 static const int uart_nr = UART_NR;
+static struct repeating_timer uplink_timer;
+static bool uplink_joined;              // set by loraInit(); the uplink timer does not start before
 static lorawan_item lorawan[] = {{"AT\r\n", "+AT: OK\r\n", STD_WAITING_TIME},
                                  {"AT+MODE=LWOTAA\r\n", "+MODE: LWOTAA\r\n", STD_WAITING_TIME},
                                  {"AT+KEY=APPKEY,\"307fb94b705bd61559329b239686f653\"\r\n", "+KEY: 307fb94b705bd61559329b239686f653\r\n", STD_WAITING_TIME},  // Linh
@@ -22,11 +25,16 @@ static lorawan_item lorawan[] = {{"AT\r\n", "+AT: OK\r\n", STD_WAITING_TIME},
                                  {"AT+CLASS=A\r\n", "+CLASS: A\r\n", STD_WAITING_TIME},
                                  {"AT+PORT=8\r\n", "+PORT: 8\r\n", STD_WAITING_TIME},
                                  {"AT+JOIN\r\n", "Network joined\r\n", MSG_WAITING_TIME}};
+static void atParserFeed(uint8_t c);
+static bool uplinkTask(struct repeating_timer *t);
+static void uplinkWake();
+
 //initialises the uart and set up llorawan communication
 bool loraInit() {
     char return_message[STRLEN];
     int lorawanState = 0;
     uart_setup(UART_NR, UART_TX_PIN, UART_RX_PIN, BAUD_RATE);
+    uart_set_rx_callback(UART_NR, atParserFeed);
 
 
     while(true) {
@@ -37,6 +45,8 @@ bool loraInit() {
         }
         if (true == loraCommunication(lorawan[lorawanState].command,lorawan[lorawanState].sleep_time, return_message)) {
             if(strstr(return_message, lorawan[lorawanState].retval) != NULL) {
+                uplink_joined = true;
+                uplinkWake();
                 return true;
             }
         }
@@ -45,37 +55,267 @@ bool loraInit() {
 }
 
 
-//sends a command via UART and waits for a response.
-bool loraCommunication(const char* command, const uint sleep_time, char* str) {
-    uart_send(uart_nr, command);
-    sleep_ms(sleep_time);
-    int pos = uart_read(UART_NR, (uint8_t *) str, STRLEN - 1);
-    if (pos > 0) {
-        str[pos] = '\0';
+// Response parser, fed byte by byte from the UART RX interrupt. It collects the response lines of the command in
+// flight and flags it complete on the terminal line: the first "+TAG: ..." line of a one-line reply, "+TAG: Done" when
+// the modem opened with "+TAG: Start", or any line reporting an error.
+typedef struct at_parser_ {
+    char tag[16];
+    size_t tag_len;
+    bool multiline;
+    char line[STRLEN];
+    size_t line_len;
+    char response[STRLEN];
+    size_t response_len;
+    volatile bool done;
+} at_parser;
+
+static at_parser parser;
+
+static bool atLineTerminal(const char *line) {
+    if (NULL != strstr(line, "ERROR") || NULL != strstr(line, "Please join network first")) {
         return true;
     }
-    return false;
+    if ('+' != line[0] || 0 != strncmp(&line[1], parser.tag, parser.tag_len) || ':' != line[parser.tag_len + 1]) {
+        return false;
+    }
+    const char *status = &line[parser.tag_len + 2];
+    if (0 == strcmp(status, " Start")) {
+        parser.multiline = true;
+        return false;
+    }
+    return !parser.multiline || 0 == strcmp(status, " Done");
+}
+
+static void atParserFeed(uint8_t c) {
+    if (parser.done) {
+        return;
+    }
+    if ('\n' != c) {
+        if (parser.line_len < STRLEN - 1) {
+            parser.line[parser.line_len++] = (char) c;
+        }
+        return;
+    }
+    parser.line[parser.line_len] = '\0';
+    if (parser.line_len > 0 && '\r' == parser.line[parser.line_len - 1]) {
+        parser.line[parser.line_len - 1] = '\0';
+    }
+    parser.response_len += snprintf(&parser.response[parser.response_len], STRLEN - parser.response_len, "%s\r\n",
+                                    parser.line);
+    if (parser.response_len > STRLEN - 1) {
+        parser.response_len = STRLEN - 1;
+    }
+    parser.line_len = 0;
+    if (atLineTerminal(parser.line)) {
+        parser.done = true;
+    }
 }
 
-//Send a custom message using the LoRaWAN device.
-bool loraMessage(const char* message, size_t msg_size, char* return_message) {
+// Prepares the parser for command, whose tag is the part between "AT+" and '=' or the line end ("AT" for plain AT).
+static void atParserStart(const char *command) {
+    irq_set_enabled(uart_get_handle(uart_nr)->irqn, false);
+    const char *tag = strncmp(command, "AT+", 3) ? command : command + 3;
+    parser.tag_len = strcspn(tag, "=\r\n");
+    if (parser.tag_len >= sizeof(parser.tag)) {
+        parser.tag_len = sizeof(parser.tag) - 1;
+    }
+    memcpy(parser.tag, tag, parser.tag_len);
+    parser.tag[parser.tag_len] = '\0';
+    parser.multiline = false;
+    parser.line_len = 0;
+    parser.response_len = 0;
+    parser.response[0] = '\0';
+    parser.done = false;
+    irq_set_enabled(uart_get_handle(uart_nr)->irqn, true);
+}
+
+//sends a command via UART and waits until its response is complete, at most timeout_ms. The uplink timer shares the
+//parser, so this fails while uplinks are queued.
+bool loraCommunication(const char* command, const uint timeout_ms, char* str) {
+    absolute_time_t deadline = make_timeout_time_ms(timeout_ms);
+
+    if (false == loraUplinkIdle()) {
+        return false;
+    }
+    atParserStart(command);
+    uart_send(uart_nr, command);
+    while (!parser.done && !best_effort_wfe_or_timeout(deadline)) {
+    }
+
+    irq_set_enabled(uart_get_handle(uart_nr)->irqn, false);
+    memcpy(str, parser.response, parser.response_len + 1);
+    parser.done = true;
+    irq_set_enabled(uart_get_handle(uart_nr)->irqn, true);
+    // like before, a partial answer is handed to the caller to judge
+    return parser.response_len > 0;
+}
+
+// Builds the AT+MSG command for message. Returns false if the message does not fit.
+static bool loraBuildMsg(const char* message, size_t msg_size, char* lorawan_message) {
     const char start_tag[] = "AT+MSG=\"";
     const char end_tag[] = "\"\r\n";
-    char lorawan_message[STRLEN];
 
     if (msg_size > STRLEN-strlen(start_tag)-strlen(end_tag)-1) {
         return false;
     }
     strcpy(lorawan_message, start_tag);
-    strncpy(&lorawan_message[strlen(start_tag)], message, STRLEN - strlen(start_tag)- strlen(end_tag)-1);
+    strncat(lorawan_message, message, msg_size);
     strcat(lorawan_message, end_tag);
-    lorawan_message[STRLEN-1] = '\0';
-    if(true == loraCommunication(lorawan_message, MSG_WAITING_TIME, return_message)) {
-        return true;
-    } else {
+    return true;
+}
+
+// Builds the AT+MSGHEX command for a binary payload. Returns false if the payload does not fit.
+static bool loraBuildMsgHex(const uint8_t* payload, size_t size, char* lorawan_message) {
+    const char start_tag[] = "AT+MSGHEX=\"";
+    const char end_tag[] = "\"\r\n";
+
+    if (2 * size > STRLEN-strlen(start_tag)-strlen(end_tag)-1) {
         return false;
     }
+    char *pos = lorawan_message + strlen(start_tag);
+    strcpy(lorawan_message, start_tag);
+    for (size_t i = 0; i < size; i++) {
+        pos += sprintf(pos, "%02X", payload[i]);
+    }
+    strcpy(pos, end_tag);
+    return true;
 }
+
+/////////////////////////////////////////////////////
+//                  UPLINK QUEUE                   //
+/////////////////////////////////////////////////////
+
+// Messages queued by loraMsgAsync() are sent one at a time by uplinkTask(), which runs from a repeating timer. The
+// caller's context only produces into the queue and the timer only consumes from it, so neither needs a lock. The
+// timer only runs while the queue has messages, so an idle modem does not wake the CPU.
+typedef struct lora_uplink_ {
+    char command[STRLEN];
+    lora_uplink_callback_t callback;
+    void *user_data;
+} lora_uplink;
+
+enum UplinkState {
+    UPLINK_IDLE,        // nothing in flight, next attempt allowed from uplink_not_before
+    UPLINK_SENDING      // command sent, waiting for the parser or uplink_deadline
+};
+
+static lora_uplink uplink_queue[UPLINK_QUEUE_SIZE];
+static atomic_uint uplink_head;     // written by loraMsgAsync() only
+static atomic_uint uplink_tail;     // written by uplinkTask() only
+static enum UplinkState uplink_state = UPLINK_IDLE;
+static absolute_time_t uplink_deadline;
+static absolute_time_t uplink_not_before;
+static int uplink_attempts;
+static atomic_bool uplink_timer_running;    // cleared by uplinkTask() when it stops the timer
+
+static void uplinkFinish(lora_uplink *uplink, bool delivered) {
+    DEBUG_PRINT("Uplink %s after %d attempt(s): %s", delivered ? "delivered" : "dropped", uplink_attempts, uplink->command);
+    if (NULL != uplink->callback) {
+        uplink->callback(delivered, uplink->user_data);
+    }
+    uplink_attempts = 0;
+    atomic_store_explicit(&uplink_tail, atomic_load_explicit(&uplink_tail, memory_order_relaxed) + 1,
+                          memory_order_release);
+}
+
+static bool uplinkTask(struct repeating_timer *t) {
+    uint32_t tail = atomic_load_explicit(&uplink_tail, memory_order_relaxed);
+    if (tail == atomic_load_explicit(&uplink_head, memory_order_acquire)) {
+        atomic_store(&uplink_timer_running, false);
+        return false;
+    }
+    lora_uplink *uplink = &uplink_queue[tail % UPLINK_QUEUE_SIZE];
+
+    switch (uplink_state) {
+        case UPLINK_IDLE:
+            if (absolute_time_diff_us(get_absolute_time(), uplink_not_before) > 0) {
+                break;
+            }
+            uplink_attempts++;
+            uplink_deadline = make_timeout_time_ms(MSG_WAITING_TIME);
+            atParserStart(uplink->command);
+            uart_send(uart_nr, uplink->command);
+            uplink_state = UPLINK_SENDING;
+            break;
+        case UPLINK_SENDING:
+            if (parser.done) {
+                char done[sizeof(parser.tag) + 8];
+                snprintf(done, sizeof(done), "+%s: Done", parser.tag);
+                bool delivered = NULL != strstr(parser.response, done) &&
+                                 NULL == strstr(parser.response, "ERROR") &&
+                                 NULL == strstr(parser.response, "Please join");
+                if (delivered || UPLINK_ATTEMPTS == uplink_attempts) {
+                    uplinkFinish(uplink, delivered);
+                }
+            } else if (absolute_time_diff_us(get_absolute_time(), uplink_deadline) <= 0) {
+                // no terminal line in time: the parser is restarted by the next attempt
+                parser.done = true;
+                if (UPLINK_ATTEMPTS == uplink_attempts) {
+                    uplinkFinish(uplink, false);
+                }
+            } else {
+                break;
+            }
+            uplink_not_before = make_timeout_time_ms(0 == uplink_attempts ? 0 : UPLINK_RETRY_DELAY);
+            uplink_state = UPLINK_IDLE;
+            break;
+    }
+    return true;
+}
+
+// Returns the next free queue entry, or NULL if the queue is full. uplinkCommit() hands it to the uplink timer.
+static lora_uplink *uplinkReserve() {
+    uint32_t head = atomic_load_explicit(&uplink_head, memory_order_relaxed);
+    if (head - atomic_load_explicit(&uplink_tail, memory_order_acquire) >= UPLINK_QUEUE_SIZE) {
+        return NULL;
+    }
+    return &uplink_queue[head % UPLINK_QUEUE_SIZE];
+}
+
+static void uplinkCommit(lora_uplink *uplink, lora_uplink_callback_t callback, void *user_data) {
+    uplink->callback = callback;
+    uplink->user_data = user_data;
+    atomic_store_explicit(&uplink_head, atomic_load_explicit(&uplink_head, memory_order_relaxed) + 1,
+                          memory_order_release);
+    uplinkWake();
+}
+
+// Starts the uplink timer unless it is running. Called after a message is queued, so a timer that has just found the
+// queue empty and stopped is started again.
+static void uplinkWake() {
+    if (true == uplink_joined && false == atomic_exchange(&uplink_timer_running, true)) {
+        add_repeating_timer_ms(UPLINK_POLL_PERIOD, uplinkTask, NULL, &uplink_timer);
+    }
+}
+
+// Queues message for sending in the background and returns at once. callback, if not NULL, is called from the
+// uplink timer once the message is delivered or given up on. Returns false if the queue is full or the message does
+// not fit into an AT+MSG command.
+bool loraMsgAsync(const char* message, size_t msg_size, lora_uplink_callback_t callback, void *user_data) {
+    lora_uplink *uplink = uplinkReserve();
+    if (NULL == uplink || false == loraBuildMsg(message, msg_size, uplink->command)) {
+        return false;
+    }
+    uplinkCommit(uplink, callback, user_data);
+    return true;
+}
+
+// Same as loraMsgAsync() for a binary payload, which is sent hex encoded with AT+MSGHEX.
+bool loraMsgHexAsync(const uint8_t* payload, size_t size, lora_uplink_callback_t callback, void *user_data) {
+    lora_uplink *uplink = uplinkReserve();
+    if (NULL == uplink || false == loraBuildMsgHex(payload, size, uplink->command)) {
+        return false;
+    }
+    uplinkCommit(uplink, callback, user_data);
+    return true;
+}
+
+// Returns true when every queued message has been delivered or given up on.
+bool loraUplinkIdle() {
+    return atomic_load_explicit(&uplink_head, memory_order_acquire) ==
+           atomic_load_explicit(&uplink_tail, memory_order_acquire);
+}
+
 //
 bool retvalChecker(const int index) {
     char return_message[STRLEN];
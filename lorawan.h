@@ -1,6 +1,7 @@
 #ifndef LORAWAN
 #define LORAWAN
 #include <stdio.h>
+#include <stdint.h>
 #include <stdbool.h>
 #if 0
 #define UART_NR 0
@@ -19,15 +20,25 @@
 
 #define STRLEN 128
 
+#define UPLINK_QUEUE_SIZE 8
+#define UPLINK_ATTEMPTS 3
+#define UPLINK_RETRY_DELAY 1000
+#define UPLINK_POLL_PERIOD 10
+
 typedef struct lorawan_item_ {
     char command[STRLEN];
     char retval[STRLEN];
-    uint sleep_time;
+    uint sleep_time;    // response timeout in ms
 } lorawan_item;
 
+// called with the outcome of a queued uplink
+typedef void (*lora_uplink_callback_t)(bool delivered, void *user_data);
+
 bool loraInit();
-bool loraCommunication(const char* command, const uint sleep_time, char* str);
-bool loraMsg(const char* message, size_t msg_size, char* return_message);
+bool loraCommunication(const char* command, const uint timeout_ms, char* str);
+bool loraMsgAsync(const char* message, size_t msg_size, lora_uplink_callback_t callback, void *user_data);
+bool loraMsgHexAsync(const uint8_t* payload, size_t size, lora_uplink_callback_t callback, void *user_data);
+bool loraUplinkIdle();
 bool retvalChecker(const int index);
 
 #endif
@@ -9,9 +9,11 @@
 #include "button.h"
 #include "uart.h"
 #include "lorawan.h"
+#include "payload.h"
 #include "state.h"
 #include "motor.h" // includes stepper motor, optofork and piezo related codes
 #include "watchdog.h"
+#include "scheduler.h"
 
 #ifdef DEBUG_PRINT
 #define DEBUG_PRINT(f_, ...)  printf((f_), ##__VA_ARGS__)
@@ -28,37 +30,81 @@
 
 #define LORAWAN_CONN
 
-#ifdef LORAWAN_CONN
-#define LORAWAN_COMM_TIME  ( MSG_WAITING_TIME )
-#else
-#define LORAWAN_COMM_TIME  ( 0 )
-#endif
+#define JOURNAL_PERIOD 1        // ms between the position journal checks while the wheel turns
+#define UPLINK_BACKLOG 8        // uplinks kept while the queue of lorawan.c is full
+#define WATCHDOG_TIMEOUT 3000   // ms, longer than any task runs
+#define WATCHDOG_FEED_PERIOD 1000
 
 /////////////////////////////////////////////////////
 //             FUNCTION DECLARATIONS               //
 /////////////////////////////////////////////////////
 
-bool repeatingTimerCallback(struct repeating_timer *t);
-bool blinkTimerCallback(struct repeating_timer *t);
+void gpioEvent(uint gpio, uint32_t event_mask);
+void buttonEvent(uint gpio, enum ButtonEvent event);
+void watchdogTask(void *context);
 void resetValues();
-void dispensePills();
-void eepromLorawanComm(const char* message, size_t msg_size);
+void calibrationDone(enum MotionStatus status, int steps, void *user_data);
+void turnDone(enum MotionStatus status, int steps, void *user_data);
+void sw0Pressed(void *context);
+void sw2Pressed(void *context);
+void calibrationFinished(void *context);
+void pillDetected(void *context);
+void dispenseNext(int compartment, absolute_time_t at);
+void turnStart(void *context);
+void turnJournal(void *context);
+void turnFinished(void *context);
+void dispenseEnd();
+void ledPattern(int toggles);
+void ledToggle(void *context);
+void uplinkRetry(void *context);
+void eepromLorawanComm(const char* message, size_t msg_size, enum PayloadEvent event);
 void noDetectBlink();
 
 /////////////////////////////////////////////////////
 //                GLOBAL VARIABLES                 //
 /////////////////////////////////////////////////////
 
-static volatile bool sw0_buttonEvent = false;
-static volatile bool sw2_buttonEvent = false;
+/* tasks of the scheduler; the interrupt handlers post the events, the others are timed */
+static int sw0_task;
+static int sw2_task;
+static int calibration_task;
+static int piezo_task;
+static int turn_task;
+static int journal_task;
+static int turned_task;
+static int led_task;
+static int uplink_task;
+static int watchdog_task;
+
+static volatile enum MotionStatus calibration_status;
+static bool recovering = false;            // the next turn finishes one cut off by a power loss
+static uint32_t wheel_corrections;          // corrections of the wheel position reported so far
+static absolute_time_t recovery_start;
+
+/* the turn in progress, or the next one while dispensing waits for its time */
+static struct {
+    bool dispensing;
+    int compartment;
+    int start;                              // steps into the turn it started at
+    bool pill;                              // the piezo felt a pill during the turn
+    absolute_time_t next;                   // when the turn after this one is due
+} turn;
+
+static int led_toggles;                     // left in the current pattern, negative blinks until cancelled
+static bool led_lit;
+
+static struct {
+    uint8_t payload[PAYLOAD_SIZE];
+    size_t size;
+} uplink_backlog[UPLINK_BACKLOG];
+static uint32_t uplink_backlog_head;
+static uint32_t uplink_backlog_tail;
+static uint32_t uplink_dropped;             // uplinks given up to make room in the full backlog
 
 static bool lora_connected = false;
 
-static char retval_str[STRLEN];
-
 extern int calibration_count;
 extern bool calibrated;
-extern bool pill_detected;
 extern bool fallingEdge;
 
 static const char *fixed_msg[8] = {"Clean boot.",
@@ -79,14 +125,8 @@ DeviceState machine = {
         .compartmentFinished = IN_THE_MIDDLE,
         .calibrationCount = 0,
         .compartmentsMoved = 0,
-        .logCounter = 0,
 };
 
-volatile int *log_counter = &machine.logCounter;
-
-static struct repeating_timer blink_timer;
-static uint32_t blink_counter;
-
 /////////////////////////////////////////////////////
 //                     MAIN                        //
 /////////////////////////////////////////////////////
@@ -97,40 +137,52 @@ int main(void) {
     stdio_init_all();
     ledsInit();
     pwmInit();
-    buttonsInit();
-    setup();
-    setupPiezoSensor();
-
-    //eraseAll(); /* Deletes all data from eeprom from log area */
+    buttonsInit(buttonEvent);
+    stepperMotorInit();
+    optoforkInit();
+    piezoInit();
+    eepromInit();
+    logInit();
+
+    //factoryReset(); /* Deletes the log, the stepper position and the device state from eeprom */
+
+    sw0_task = schedulerAddTask("sw0", sw0Pressed, NULL);
+    sw2_task = schedulerAddTask("sw2", sw2Pressed, NULL);
+    calibration_task = schedulerAddTask("calibration", calibrationFinished, NULL);
+    piezo_task = schedulerAddTask("piezo", pillDetected, NULL);
+    turn_task = schedulerAddTask("turn", turnStart, NULL);
+    journal_task = schedulerAddTask("journal", turnJournal, NULL);
+    turned_task = schedulerAddTask("turned", turnFinished, NULL);
+    led_task = schedulerAddTask("led", ledToggle, NULL);
+    uplink_task = schedulerAddTask("uplink", uplinkRetry, NULL);
+    watchdog_task = schedulerAddTask("watchdog", watchdogTask, NULL);
 
 #ifdef LORAWAN_CONN
     /* Initializes lorawan */
-    /*
     while (!lora_connected) {
         lora_connected = loraInit();
-    }*/
+    }
 #endif
 
 #if 0
     /* to set the uart TIMEOUT value: */
+    char retval_str[STRLEN];
     if (true == loraCommunication("AT+UART=TIMEOUT,0\r\n", STD_WAITING_TIME, retval_str)) {
         printf("%s\n",retval_str);
     }
 #endif
 
-    struct repeating_timer button_timer;
-    add_repeating_timer_ms(BUTTON_PERIOD, repeatingTimerCallback, NULL, &button_timer);
-    gpio_set_irq_enabled_with_callback(OPTOFORK, GPIO_IRQ_EDGE_FALL, true, gpioFallingEdge);
+    gpio_set_irq_enabled_with_callback(OPTOFORK, GPIO_IRQ_EDGE_FALL, true, gpioEvent);
     gpio_set_irq_enabled(PIEZO, GPIO_IRQ_EDGE_FALL, true);
 
     if (read_from_eeprom(&machine)) {
         if (machine.currentState == CALIB_WAITING) {
             if (watchdog_caused_reboot()) {
-                eepromLorawanComm(fixed_msg[7], strlen(fixed_msg[7]));
+                eepromLorawanComm(fixed_msg[7], strlen(fixed_msg[7]), EVENT_WATCHDOG_REBOOT);
             } else {
-                eepromLorawanComm(fixed_msg[0], strlen(fixed_msg[0]));
+                eepromLorawanComm(fixed_msg[0], strlen(fixed_msg[0]), EVENT_CLEAN_BOOT);
             }
-            eepromLorawanComm(fixed_msg[6], strlen(fixed_msg[6]));
+            eepromLorawanComm(fixed_msg[6], strlen(fixed_msg[6]), EVENT_WAITING_CALIBRATION);
         }
         if (machine.currentState == DISPENSE_WAITING) {
             calibration_count = machine.calibrationCount;
@@ -139,91 +191,61 @@ int main(void) {
             allLedsOff();
 
             if (watchdog_caused_reboot()) {
-                eepromLorawanComm(fixed_msg[7], strlen(fixed_msg[7]));
+                eepromLorawanComm(fixed_msg[7], strlen(fixed_msg[7]), EVENT_WATCHDOG_REBOOT);
             } else {
-                eepromLorawanComm(fixed_msg[0], strlen(fixed_msg[0]));
+                eepromLorawanComm(fixed_msg[0], strlen(fixed_msg[0]), EVENT_CLEAN_BOOT);
             }
 
             switch (machine.compartmentFinished) {
                 case IN_THE_MIDDLE:
 
                     if (0 != machine.compartmentsMoved) {
-                        eepromLorawanComm(fixed_msg[3], strlen(fixed_msg[3]));
+                        eepromLorawanComm(fixed_msg[3], strlen(fixed_msg[3]), EVENT_POWER_OFF_TURNING);
                     }
 
-                    realignMotor();
-                    sleep_ms(COMPARTMENT_TIME);
-                    machine.compartmentFinished = FINISHED;
-                    write_to_eeprom(&machine);
-                    dispensePills();
-                    printLog();
-                    resetValues();
-                    machine.currentState = CALIB_WAITING;
+                    /* the interrupted turn goes on from where the wheel stopped, as the first turn left */
+                    recovery_start = get_absolute_time();
+                    recovering = true;
+                    realignMotor(machine.compartmentsMoved);
+                    dispenseNext(machine.compartmentsMoved, get_absolute_time());
                     break;
                 case FINISHED:
+                    wheelAtCompartment(machine.compartmentsMoved);
                     if (0 == machine.compartmentsMoved) {
-                        eepromLorawanComm(fixed_msg[5], strlen(fixed_msg[5]));
+                        eepromLorawanComm(fixed_msg[5], strlen(fixed_msg[5]), EVENT_BOOT_AFTER_CALIBRATION);
                         machine.compartmentsMoved = 1;
                         allLedsOn();
                         break;
                     } else {
                         machine.compartmentsMoved++;
-                        eepromLorawanComm(fixed_msg[2], strlen(fixed_msg[2]));
-                        sleep_ms(COMPARTMENT_TIME);
-                        dispensePills();
-                        printLog();
-                        resetValues();
-                        machine.currentState = CALIB_WAITING;
+                        eepromLorawanComm(fixed_msg[2], strlen(fixed_msg[2]), EVENT_POWER_OFF_IDLE);
+                        if (COMPARTMENTS > machine.compartmentsMoved) {
+                            dispenseNext(machine.compartmentsMoved, make_timeout_time_ms(COMPARTMENT_TIME));
+                        } else {
+                            dispenseEnd();
+                        }
                         break;
                     }
             }
         }
     } else {
         if (watchdog_caused_reboot()) {
-            eepromLorawanComm(fixed_msg[7], strlen(fixed_msg[7]));
+            eepromLorawanComm(fixed_msg[7], strlen(fixed_msg[7]), EVENT_WATCHDOG_REBOOT);
         } else {
-            eepromLorawanComm(fixed_msg[0], strlen(fixed_msg[0]));
+            eepromLorawanComm(fixed_msg[0], strlen(fixed_msg[0]), EVENT_CLEAN_BOOT);
         }
-        eepromLorawanComm(fixed_msg[6], strlen(fixed_msg[6]));
+        eepromLorawanComm(fixed_msg[6], strlen(fixed_msg[6]), EVENT_WAITING_CALIBRATION);
     }
 
-    watchdogInit(20);
-
-    while(true) {
-        if (true == sw0_buttonEvent) {
-            sw0_buttonEvent = false;
-            switch (machine.currentState) {
-                case CALIB_WAITING:
-                    calibrateMotor(); /* calibrates and aligns */
-                    allLedsOn();
-                    machine.currentState = DISPENSE_WAITING;
-                    machine.calibrationCount = calibration_count;
-                    machine.compartmentFinished = 1;
-                    eepromLorawanComm(fixed_msg[1], strlen(fixed_msg[1]));
-                    break;
-                case DISPENSE_WAITING:
-                    break;
-            }
-        }
+    if (CALIB_WAITING == machine.currentState) {
+        ledPattern(-1);
+    }
 
-        if (true == sw2_buttonEvent) {
-            sw2_buttonEvent = false;
-            switch (machine.currentState) {
-                case CALIB_WAITING:
-                    break;
-                case DISPENSE_WAITING:
-                    machine.compartmentsMoved = 1;
-                    dispensePills();
-                    printLog();
-                    resetValues();
-                    break;
-            }
-        }
+    watchdogInit(WATCHDOG_TIMEOUT);
+    schedulerRunIn(watchdog_task, WATCHDOG_FEED_PERIOD);
 
-        if (CALIB_WAITING == machine.currentState) {
-            blink();
-        }
-    }
+    /* every button press, sensor edge, finished move and timed task runs from here */
+    schedulerRun();
     return 0;
 }
 
@@ -232,131 +254,301 @@ int main(void) {
 /////////////////////////////////////////////////////
 
 /**********************************************************************************************************************
- * \brief: Function called by timer to check if SW_0 or SW_2 buttons were pressed. Filtered button press sets the
- *         button event flag respectively.
+ * \brief: GPIO interrupt handler. Hands the button edges to button.c, keeps the optofork and piezo flags of motor.c
+ *         and posts a pill seen by the piezo to the scheduler.
  *
- * \param: struct repeating_timer *t, not used.
+ * \param: 2 params: the GPIO number and the events of the pin.
  *
- * \return: boolean, returns true everytime function is called.
+ * \return:
+ *
+ * \remarks: The step timer samples the optofork itself, its edges need no task.
+ **********************************************************************************************************************/
+void gpioEvent(uint gpio, uint32_t event_mask) {
+    if (true == buttonEdge(gpio, event_mask)) {
+        return;
+    }
+    gpioFallingEdge(gpio, event_mask);
+    if (PIEZO == gpio) {
+        schedulerPost(piezo_task);
+    }
+}
+
+/**********************************************************************************************************************
+ * \brief: Button callback of button.c. A press of SW_0 or SW_2 posts the event of the button to the scheduler.
+ *
+ * \param: 2 params: the GPIO number of the button and what it did.
+ *
+ * \return:
+ *
+ * \remarks: Runs in the GPIO or timer interrupt. The buttons act as soon as they go down; long and double presses
+ *           have no meaning yet.
+ **********************************************************************************************************************/
+void buttonEvent(uint gpio, enum ButtonEvent event) {
+    if (BUTTON_PRESS == event) {
+        schedulerPost(SW_0 == gpio ? sw0_task : sw2_task);
+    }
+}
+
+/**********************************************************************************************************************
+ * \brief: Watchdog task. Feeds the watchdog and times itself again.
+ *
+ * \param: void *context, not used.
+ *
+ * \return:
+ *
+ * \remarks: Running as a task, it stops feeding when a task hangs or the scheduler stops.
+ **********************************************************************************************************************/
+void watchdogTask(void *context) {
+    watchdogFeed();
+    schedulerRunIn(watchdog_task, WATCHDOG_FEED_PERIOD);
+}
+
+/**********************************************************************************************************************
+ * \brief: Completion callback of calibrateMotorAsync(). Hands the outcome to the calibration task.
+ *
+ * \param: 3 params: the status the calibration ended with, the steps per revolution and the unused user data.
+ *
+ * \return:
+ *
+ * \remarks: Runs in the timer interrupt.
+ **********************************************************************************************************************/
+void calibrationDone(enum MotionStatus status, int steps, void *user_data) {
+    calibration_status = status;
+    schedulerPost(calibration_task);
+}
+
+/**********************************************************************************************************************
+ * \brief: Completion callback of the move of a turn. Hands the end of the turn to the turned task.
+ *
+ * \param: 3 params: the status the move ended with, the steps it took and the unused user data.
+ *
+ * \return:
+ *
+ * \remarks: Runs in the timer interrupt.
+ **********************************************************************************************************************/
+void turnDone(enum MotionStatus status, int steps, void *user_data) {
+    schedulerPost(turned_task);
+}
+
+/**********************************************************************************************************************
+ * \brief: Task of SW_0. Starts the calibration while the dispenser waits for it.
+ *
+ * \param: void *context, not used.
+ *
+ * \return:
  *
  * \remarks:
  **********************************************************************************************************************/
-bool repeatingTimerCallback(struct repeating_timer *t) {
-    /* SW0 */
-    static uint sw0_button_state = 0, sw0_filter_counter = 0;
-    uint sw0_new_state = gpio_get(SW_0);
-    if (sw0_button_state != sw0_new_state) {
-        if (++sw0_filter_counter >= BUTTON_FILTER) {
-            sw0_button_state = sw0_new_state;
-            sw0_filter_counter = 0;
-            if (sw0_new_state != SW0_RELEASED) {
-                sw0_buttonEvent = true;
-            }
-        }
-    } else {
-        sw0_filter_counter = 0;
+void sw0Pressed(void *context) {
+    switch (machine.currentState) {
+        case CALIB_WAITING:
+            /* calibrates and aligns in the background, ignored while a calibration is running */
+            calibrateMotorAsync(machine.calibrationCount, calibrationDone, NULL);
+            break;
+        case DISPENSE_WAITING:
+            break;
     }
-    /* SW2 */
-    static uint sw2_button_state = 0, sw2_filter_counter = 0;
-    uint sw2_new_state = gpio_get(SW_2);
-    if (sw2_button_state != sw2_new_state) {
-        if (++sw2_filter_counter >= BUTTON_FILTER) {
-            sw2_button_state = sw2_new_state;
-            sw2_filter_counter = 0;
-            if (sw2_new_state != SW2_RELEASED) {
-                sw2_buttonEvent = true;
+}
+
+/**********************************************************************************************************************
+ * \brief: Task of SW_2. Starts dispensing once the wheel is calibrated.
+ *
+ * \param: void *context, not used.
+ *
+ * \return:
+ *
+ * \remarks: Ignored while the pills of a week are being dispensed.
+ **********************************************************************************************************************/
+void sw2Pressed(void *context) {
+    switch (machine.currentState) {
+        case CALIB_WAITING:
+            break;
+        case DISPENSE_WAITING:
+            if (false == turn.dispensing) {
+                dispenseNext(1, get_absolute_time());
             }
+            break;
+    }
+}
+
+/**********************************************************************************************************************
+ * \brief: Task run at the end of a calibration. Stores the result and waits for the button to dispense.
+ *
+ * \param: void *context, not used.
+ *
+ * \return:
+ *
+ * \remarks: A failed calibration leaves the LEDs blinking for another try.
+ **********************************************************************************************************************/
+void calibrationFinished(void *context) {
+    if (MOTION_DONE == calibration_status) {
+        if (0 != machine.calibrationCount && calibration_count != machine.calibrationCount) {
+            DEBUG_PRINT("Stored steps per revolution %d do not match, measured again.\n", machine.calibrationCount);
         }
-    } else {
-        sw2_filter_counter = 0;
+        DEBUG_PRINT("Number of steps per revolution: %d\n", calibration_count);
+        schedulerCancel(led_task);
+        allLedsOn();
+        machine.currentState = DISPENSE_WAITING;
+        machine.calibrationCount = calibration_count;
+        machine.compartmentFinished = 1;
+        eepromLorawanComm(fixed_msg[1], strlen(fixed_msg[1]), EVENT_CALIBRATED);
     }
-    watchdogFeed();
-    return true;
 }
 
 /**********************************************************************************************************************
- * \brief: Function called by timer to blink 5 times if pill not detected from compartment.
+ * \brief: Task of the piezo sensor. Counts the pill for the turn in progress.
+ *
+ * \param: void *context, not used.
+ *
+ * \return:
+ *
+ * \remarks: The pill lands before the move ends, so its event is always ahead of the one of the end of the turn.
+ **********************************************************************************************************************/
+void pillDetected(void *context) {
+    turn.pill = true;
+}
+
+/**********************************************************************************************************************
+ * \brief: Times the turn to compartment. Dispenses 7 pills resided in 7 different compartments using stepper motor,
+ *         one turn at a time; every turn times the one after it.
  *
- * \param: struct repeating_timer *t, not used.
+ * \param: 2 params: the compartment to turn to and when to start the turn.
  *
- * \return: boolean, returns true if blink_counter is greater than zero, else returns false.
+ * \return:
  *
  * \remarks:
  **********************************************************************************************************************/
-bool blinkTimerCallback(struct repeating_timer *t) {
-    if (blink_counter % 2) {
+void dispenseNext(int compartment, absolute_time_t at) {
+    if (false == turn.dispensing) {
+        turn.dispensing = true;
+        schedulerCancel(led_task);
         allLedsOff();
-    } else {
-        allLedsOn();
     }
-    blink_counter--;
+    turn.compartment = compartment;
+    schedulerRunAt(turn_task, at);
+}
 
-    if (blink_counter) {
-        return true;
-    } else {
-        return false;
+/**********************************************************************************************************************
+ * \brief: Task starting a turn. Commits that the wheel is turning and starts the move; turnFinished() takes over when
+ *         it ends.
+ *
+ * \param: void *context, not used.
+ *
+ * \return:
+ *
+ * \remarks:
+ **********************************************************************************************************************/
+void turnStart(void *context) {
+    /* LoRaWAN messages take as long as the modem needs, so the next turn is timed from the start of this one */
+    turn.next = make_timeout_time_ms(COMPARTMENT_TIME);
+    turn.pill = false;
+    machine.compartmentsMoved = turn.compartment;
+
+    /* the position of the previous turn has to be gone before the state says the wheel is turning; a turn that
+     * finishes one cut off by a power loss starts part of the way */
+    turn.start = true == recovering ? wheelStepsPast(machine.compartmentsMoved - 1) : 0;
+    positionWrite(turn.start, true);
+    machine.compartmentFinished = IN_THE_MIDDLE;
+    write_to_eeprom(&machine);
+    if (false == moveToCompartmentAsync(machine.compartmentsMoved, turnDone, NULL)) {
+        DEBUG_PRINT("The motor did not start the turn.\n");
     }
+    schedulerRunIn(journal_task, JOURNAL_PERIOD);
 }
 
 /**********************************************************************************************************************
- * \brief: Dispenses 7 pills resided in 7 different compartments using stepper motor. Controls led lights and blinking
- *         according to events. During the process the function also updates the states and counters, and creates log
- *         messages respectively that are transmitted both to EEPROM and via LoRaWAN to network.
+ * \brief: Task journaling the position of the wheel while it turns.
  *
- * \param:
+ * \param: void *context, not used.
+ *
+ * \return:
+ *
+ * \remarks: The timer turns the wheel, the journal takes its position whenever the EEPROM is free.
+ **********************************************************************************************************************/
+void turnJournal(void *context) {
+    int steps = 0;
+    if (MOTION_RUNNING == motionStatus(&steps)) {
+        positionWrite(turn.start + steps, false);
+        schedulerRunIn(journal_task, JOURNAL_PERIOD);
+    }
+}
+
+/**********************************************************************************************************************
+ * \brief: Task run at the end of a turn. Commits the turn, reports the pill and times the next turn. After the last
+ *         one the dispenser waits for the button to calibrate again.
+ *
+ * \param: void *context, not used.
  *
  * \return:
  *
  * \remarks:
  **********************************************************************************************************************/
-void dispensePills() {
+void turnFinished(void *context) {
     char dispensed_msg[STRLEN/2-3];
-    bool pill_dispensed = false;
-
-    allLedsOff();
-
-    /* start dispensing pills */
-    for (; machine.compartmentsMoved < COMPARTMENTS; machine.compartmentsMoved++) {
-
-        pill_detected = false;
-        pill_dispensed = false;
+    int steps = 0;
+
+    motionStatus(&steps);
+    schedulerCancel(journal_task);
+    positionWrite(turn.start + steps, true);
+
+    /* the step alarm only counts the corrections, they are reported from here */
+    wheel_stats wheel;
+    wheelGetStats(&wheel);
+    if (wheel.corrections != wheel_corrections) {
+        wheel_corrections = wheel.corrections;
+        DEBUG_PRINT("Revolution of %d steps, %d calibrated. Position corrected by %d steps.\n", wheel.last_revolution,
+                    calibration_count, wheel.last_error);
+    }
 
-        for (int i = 0; i < (calibration_count / COMPARTMENTS + COMPARTMENTS - 1); i++) {
-            runMotorClockwise(1);
-            if (i == 0) {
-                machine.compartmentFinished = IN_THE_MIDDLE;
-                writeStruct(&machine);
-            }
-            if (i % 4 == 0) {
-                eepromWriteByte_NoDelay(STEPPER_POSITION_ADDRESS, i/4);
-            }
-            if (true == pill_detected) {
-                pill_detected = false;
-                pill_dispensed = true;
-            }
-        }
+    if (true == recovering) {
+        recovering = false;
+        sprintf(dispensed_msg, "Realigned in %lu ms, %d steps.", (unsigned long)
+                (absolute_time_diff_us(recovery_start, get_absolute_time()) / 1000), steps);
+        DEBUG_PRINT("%s\n", dispensed_msg);
+        writeLogEntry(dispensed_msg);
+    }
 
-        machine.compartmentFinished = FINISHED;
-        writeStruct(&machine);
+    machine.compartmentFinished = FINISHED;
+    write_to_eeprom(&machine);
 
-        if (true == pill_dispensed) {
-            sprintf(dispensed_msg, "Day %d: Pill dispensed. Number of pills left: %d.", (const char *) machine.compartmentsMoved, COMPARTMENTS - machine.compartmentsMoved - 1);
-            eepromLorawanComm(dispensed_msg, strlen(dispensed_msg));
-        } else {
-            noDetectBlink();
-            sprintf(dispensed_msg, "Day %d: Pill not dispensed. Number of pills left: %d.", (const char *) machine.compartmentsMoved, COMPARTMENTS - machine.compartmentsMoved - 1);
-            eepromLorawanComm(dispensed_msg, strlen(dispensed_msg));
-        }
+    if (true == turn.pill) {
+        sprintf(dispensed_msg, "Day %d: Pill dispensed. Number of pills left: %d.", machine.compartmentsMoved, COMPARTMENTS - machine.compartmentsMoved - 1);
+        eepromLorawanComm(dispensed_msg, strlen(dispensed_msg), EVENT_PILL_DISPENSED);
+    } else {
+        noDetectBlink();
+        sprintf(dispensed_msg, "Day %d: Pill not dispensed. Number of pills left: %d.", machine.compartmentsMoved, COMPARTMENTS - machine.compartmentsMoved - 1);
+        eepromLorawanComm(dispensed_msg, strlen(dispensed_msg), EVENT_PILL_MISSED);
+    }
 
-        if ((COMPARTMENTS - 1) > machine.compartmentsMoved) {
-            sleep_ms(COMPARTMENT_TIME - I2C_MEM_WRITE_TIME - LORAWAN_COMM_TIME);
-        } else {
-            eepromLorawanComm(fixed_msg[4], strlen(fixed_msg[4]));
-            sleep_ms(MSG_WAITING_TIME);
-        }
+    if ((COMPARTMENTS - 1) > machine.compartmentsMoved) {
+        dispenseNext(machine.compartmentsMoved + 1, turn.next);
+    } else {
+        eepromLorawanComm(fixed_msg[4], strlen(fixed_msg[4]), EVENT_ALL_DISPENSED);
+        dispenseEnd();
     }
 }
 
+/**********************************************************************************************************************
+ * \brief: Ends the week of dispensing. Prints the log and the scheduler statistics and waits for the button to
+ *         calibrate.
+ *
+ * \param:
+ *
+ * \return:
+ *
+ * \remarks:
+ **********************************************************************************************************************/
+void dispenseEnd() {
+    turn.dispensing = false;
+    printLog();
+#ifdef DEBUG_PRINT
+    schedulerPrintStats();
+#endif
+    DEBUG_PRINT("Uplinks dropped: %lu\n", (unsigned long) uplink_dropped);
+    resetValues();
+    ledPattern(-1);
+}
+
 /**********************************************************************************************************************
  * \brief: Resets the variables of the struct to their initial states and updates these values to EEPROM.
  *
@@ -364,38 +556,82 @@ void dispensePills() {
  *
  * \return:
  *
- * \remarks: machine.logCounter is not reset to persist the existing log messages.
+ * \remarks: The log is not touched; it keeps the history of earlier dispensing cycles. The steps per revolution are
+ *           kept too, the next calibration only checks them.
  **********************************************************************************************************************/
 void resetValues() {
     machine.currentState = CALIB_WAITING;
     machine.compartmentFinished = IN_THE_MIDDLE;
-    machine.calibrationCount = 0;
     machine.compartmentsMoved = 0;
-    machine.logCounter = 0;
-    writeStruct(&machine);
+    write_to_eeprom(&machine);
 }
 
 /**********************************************************************************************************************
- * \brief: Transmits passed message to EEPROM as a log message and also via LoRaWAN to the network. Updates the struct
- *         to EEPROM.
+ * \brief: Transmits passed message to EEPROM as a log message and queues the matching binary event for LoRaWAN
+ *         transmission to the network. Updates the struct to EEPROM.
  *
- * \param: 2 params: pointer to a const char message and its length as size_t type.
+ * \param: 3 params: pointer to a const char message, its length as size_t type and the event code of the message.
  *
  * \return:
  *
- * \remarks:
+ * \remarks: Never waits; while the uplink queue is full the message waits in the backlog of the uplink task. A full
+ *           backlog gives up its oldest uplink, which is logged and counted.
  **********************************************************************************************************************/
-void eepromLorawanComm(const char* message, size_t msg_size) {
+void eepromLorawanComm(const char* message, size_t msg_size, enum PayloadEvent event) {
     DEBUG_PRINT("%s\n", message);
     writeLogEntry(message);
+#ifdef LORAWAN_CONN
+    /* the sequence number is stored before the uplink is queued, so no reset makes it send a number twice */
+    machine.uplinkSequence++;
+#endif
     write_to_eeprom(&machine);
 #ifdef LORAWAN_CONN
-    loraMsg(message, msg_size, retval_str);
+    payload_event uplink = {
+            .event = event,
+            .day = machine.compartmentsMoved,
+            .pills_left = machine.compartmentsMoved < COMPARTMENTS ? COMPARTMENTS - machine.compartmentsMoved - 1 : 0,
+            .flags = (watchdog_caused_reboot() ? PAYLOAD_FLAG_WATCHDOG : 0) | (calibrated ? PAYLOAD_FLAG_CALIBRATED : 0),
+            .sequence = (uint16_t) machine.uplinkSequence,
+    };
+    /* the uplink task sends it later if the queue is full, after the ones waiting already; the newest events matter
+     * most, and the gap in the sequence numbers tells the network which one was lost */
+    if (UPLINK_BACKLOG == uplink_backlog_head - uplink_backlog_tail) {
+        uplink_backlog_tail++;
+        uplink_dropped++;
+        DEBUG_PRINT("Uplink backlog full, %lu uplink(s) dropped.\n", (unsigned long) uplink_dropped);
+        writeLogEntry("Uplink backlog full, oldest uplink dropped.");
+        /* no state write follows to take the log entry to the EEPROM */
+        eepromSync();
+    }
+    uint32_t slot = uplink_backlog_head++ % UPLINK_BACKLOG;
+    uplink_backlog[slot].size = payloadEncode(&uplink, uplink_backlog[slot].payload);
+    uplinkRetry(NULL);
 #endif
 }
 
 /**********************************************************************************************************************
- * \brief: Activates the timer to no pill detection blinking.
+ * \brief: Uplink task. Hands the waiting uplinks to the queue of lorawan.c as long as it has room.
+ *
+ * \param: void *context, not used.
+ *
+ * \return:
+ *
+ * \remarks: Runs again every UPLINK_POLL_PERIOD ms while the queue is full.
+ **********************************************************************************************************************/
+void uplinkRetry(void *context) {
+    while (uplink_backlog_head != uplink_backlog_tail) {
+        uint32_t slot = uplink_backlog_tail % UPLINK_BACKLOG;
+        if (false == loraMsgHexAsync(uplink_backlog[slot].payload, uplink_backlog[slot].size, NULL, NULL) &&
+            false == loraUplinkIdle()) {
+            schedulerRunIn(uplink_task, UPLINK_POLL_PERIOD);
+            return;
+        }
+        uplink_backlog_tail++;
+    }
+}
+
+/**********************************************************************************************************************
+ * \brief: Starts the no pill detection blinking, 5 times.
  *
  * \param:
  *
@@ -404,7 +640,42 @@ void eepromLorawanComm(const char* message, size_t msg_size) {
  * \remarks:
  **********************************************************************************************************************/
 void noDetectBlink() {
-    blink_counter = BLINK_TIMES * 2 - 1;
-    add_repeating_timer_ms(BLINK_SLEEP_TIME, blinkTimerCallback, NULL, &blink_timer);
+    ledPattern(BLINK_TIMES * 2 - 1);
+}
+
+/**********************************************************************************************************************
+ * \brief: Lights the LEDs and lets the LED task toggle them every BLINK_SLEEP_TIME ms, replacing the pattern running.
+ *
+ * \param: int toggles, how many times the LEDs change after being lit; negative blinks until the task is cancelled.
+ *
+ * \return:
+ *
+ * \remarks:
+ **********************************************************************************************************************/
+void ledPattern(int toggles) {
+    led_toggles = toggles;
+    led_lit = true;
     allLedsOn();
+    schedulerRunIn(led_task, BLINK_SLEEP_TIME);
+}
+
+/**********************************************************************************************************************
+ * \brief: LED task. Toggles the LEDs and times itself again until the pattern is over.
+ *
+ * \param: void *context, not used.
+ *
+ * \return:
+ *
+ * \remarks:
+ **********************************************************************************************************************/
+void ledToggle(void *context) {
+    led_lit = !led_lit;
+    if (true == led_lit) {
+        allLedsOn();
+    } else {
+        allLedsOff();
+    }
+    if (0 > led_toggles || 0 < --led_toggles) {
+        schedulerRunIn(led_task, BLINK_SLEEP_TIME);
+    }
 }
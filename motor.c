@@ -1,26 +1,70 @@
 #include "pico/stdlib.h"
-#include "steppermotor.h"
+#include "motor.h"
+#include <math.h>
 #include <stdio.h>
-#include "eeprom.h"
+#include "state.h"
 
-#ifndef DEBUG_PRINT
+#ifdef DEBUG_PRINT
 #define DEBUG_PRINT(f_, ...)  printf((f_), ##__VA_ARGS__)
 #else
 #define DEBUG_PRINT(f_, ...)
 #endif
 
 static const int stepper_array[] = {IN1, IN2, IN3, IN4};
-static const uint turning_sequence[8][4] = {{1, 0, 0, 0},
-                                            {1, 1, 0, 0},
-                                            {0, 1, 0, 0},
-                                            {0, 1, 1, 0},
-                                            {0, 0, 1, 0},
-                                            {0, 0, 1, 1},
-                                            {0, 0, 0, 1},
-                                            {1, 0, 0, 1}};
+
+/* Coil pattern of each row of the half step sequence as one word for gpio_put_masked() */
+#define COILS(in1, in2, in3, in4) ((in1) << IN1 | (in2) << IN2 | (in3) << IN3 | (in4) << IN4)
+#define COIL_MASK COILS(1u, 1u, 1u, 1u)
+static const uint32_t turning_sequence[8] = {COILS(1u, 0u, 0u, 0u),
+                                             COILS(1u, 1u, 0u, 0u),
+                                             COILS(0u, 1u, 0u, 0u),
+                                             COILS(0u, 1u, 1u, 0u),
+                                             COILS(0u, 0u, 1u, 0u),
+                                             COILS(0u, 0u, 1u, 1u),
+                                             COILS(0u, 0u, 0u, 1u),
+                                             COILS(1u, 0u, 0u, 1u)};
 
 static volatile int row = 0;
 
+/* Moves run from a timer alarm, one step per callback. ramp_us[n] is the time after the n-th step of a speed-up,
+ * from STEPPER_START_RATE to STEPPER_MAX_RATE at STEPPER_ACCELERATION; the slow-down uses it backwards, and short moves
+ * turn around before reaching the top speed. */
+static uint32_t ramp_us[STEPPER_RAMP_STEPS];
+static int ramp_length;
+
+static struct {
+    int direction;              // 1 anticlockwise, -1 clockwise
+    int total;
+    int ramp_limit;             // entries of ramp_us the move may use; 1 keeps it at the start rate
+    bool seek;                  // ends at the first optofork falling edge
+    bool track;                 // takes as many more steps as the optofork shows the wheel has lost
+    bool level;                 // of the optofork before the step
+    int edge;                   // steps to the falling edge, -1 until it has been seen
+    int ramp;                   // entry of ramp_us the last step waited for
+    volatile int done;          // steps taken so far
+    volatile bool cancel;       // asked for by motionCancel()
+    bool cancelled;             // the move has been cut short
+    volatile enum MotionStatus status;
+    motion_callback_t callback;
+    void *user_data;
+} move = {.status = MOTION_IDLE};
+
+static struct {
+    int stage;
+    int expected;               // steps per revolution from an earlier calibration, 0 if unknown
+    bool reference;             // the first edge has been found exactly
+    int position;               // clockwise steps from the reference edge
+    int direction;              // of the running move, 1 clockwise
+    motion_callback_t callback;
+    void *user_data;
+} calibration;
+
+/* The wheel is tracked by the steps it has turned clockwise since the optofork last saw the slot. Each falling edge
+ * puts the wheel ALIGNMENT steps past compartment 0, whatever the count says, so steps lost on the way are found once a
+ * revolution and made up for by the move that is running. */
+static bool wheel_known;        // set by a calibration or wheelAtCompartment()
+static wheel_stats wheel;
+
 volatile int calibration_count;
 volatile int revolution_counter = 0;
 volatile int calibration_count = 0;
@@ -35,54 +79,334 @@ void stepperMotorInit() {//Initializes stepper motor.
         gpio_init(stepper_array[i]);
         gpio_set_dir(stepper_array[i], GPIO_OUT);
     }
-}
-
-void calibrateMotor() {//  Calibrates motor by rotating the stepper motor and counting the number opf steps between two falling edge
-    calibrated = false;
-    fallingEdge = false;
-    while (false == fallingEdge) {
-        runMotorClockwise(1);
+    /* v(n) = sqrt(v0^2 + 2an) */
+    for (ramp_length = 0; ramp_length < STEPPER_RAMP_STEPS; ramp_length++) {
+        float rate = sqrtf((float) STEPPER_START_RATE * STEPPER_START_RATE + 2.0f * STEPPER_ACCELERATION * ramp_length);
+        if (rate >= STEPPER_MAX_RATE) {
+            break;
+        }
+        ramp_us[ramp_length] = (uint32_t) (1000000.0f / rate);
     }
-    fallingEdge = false;
-    while (false == fallingEdge) {
-        runMotorClockwise(1);
+    if (ramp_length < STEPPER_RAMP_STEPS) {
+        ramp_us[ramp_length++] = 1000000 / STEPPER_MAX_RATE;
     }
-    calibrated = true;
-    DBG_PRINT("Number of steps per revolution: %u\n", calibration_count);
-    runMotorAntiClockwise(ALIGNMENT);
 }
 
+// Steps it takes to slow down from the speed of the given step of the move to the start rate.
+static int rampIndex(int step) {
+    int ramp = step < move.total - 1 - step ? step : move.total - 1 - step;
+    return ramp < move.ramp_limit ? ramp : move.ramp_limit - 1;
+}
+
+// Steps into the range 0 .. calibration_count - 1.
+static int wheelWrap(int steps) {
+    steps %= calibration_count;
+    return 0 > steps ? steps + calibration_count : steps;
+}
 
-void runMotorAntiClockwise(int times) {//Rotates stepper motor anticlockwise by the number of integer passed as parameter.
+// Steps to the nearest turn of the wheel, from -calibration_count / 2 to calibration_count / 2.
+static int wheelOffset(int steps) {
+    steps = wheelWrap(steps);
+    return steps > calibration_count / 2 ? steps - calibration_count : steps;
+}
 
-    for(int i  = 0; i < times; i++) {
-        for (int j = 0; j < sizeof(stepper_array) / sizeof(stepper_array[0]); j++) {
-            gpio_put(stepper_array[j], turning_sequence[row][j]);
-        }
-        if (++row >= 8) {
-            row = 0;
+// Clockwise steps from compartment 0 to the given one. The revolution rarely divides by COMPARTMENTS, so the
+// remainder is spread over the compartments the way Bresenham spreads it over a line: each one is rounded on its own,
+// the turns differ by one step at most and never add up to more than half a step off.
+static int compartmentPosition(int compartment) {
+    compartment = (compartment % COMPARTMENTS + COMPARTMENTS) % COMPARTMENTS;
+    return (compartment * calibration_count + COMPARTMENTS / 2) / COMPARTMENTS;
+}
+
+// Called on every falling edge of the optofork while turning clockwise. Compares the steps counted since the last
+// edge with the calibrated revolution and returns how many of them the wheel did not turn, negative if it turned
+// further, then starts counting the next revolution. Runs in the step alarm, so a correction is only counted in wheel
+// for the tasks to report.
+static int wheelEdge() {
+    int lost = 0;
+    if (true == wheel_known) {
+        lost = wheelOffset(revolution_counter - calibration_count);
+        wheel.edges++;
+        wheel.last_revolution = revolution_counter;
+        wheel.last_error = lost;
+        if (0 != lost) {
+            wheel.corrections++;
+            wheel.lost_steps += 0 > lost ? -lost : lost;
         }
-        sleep_ms(2);
     }
+    revolution_counter = 0;
+    return lost;
 }
 
+static int64_t motionFinish(enum MotionStatus status) {
+#if !STEPPER_HOLD
+    /* row keeps the phase, so the next move energizes the coils one step on from where they were */
+    gpio_put_masked(COIL_MASK, 0);
+#endif
+    move.status = status;
+    if (NULL != move.callback) {
+        /* the callback may start the next move right away, so move is not touched after it */
+        move.callback(status, MOTION_DONE == status && true == move.seek ? move.edge : move.done, move.user_data);
+    }
+    return 0;
+}
 
-    for(; times > 0; times--) {//Rotates stepper motor clockwise by the number of integer passed as parameter.
-        for (int j = 0; j < sizeof(stepper_array) / sizeof(stepper_array[0]); j++) {
-            gpio_put(stepper_array[j], turning_sequence[row][j]);
+// Takes the next step of the move and returns the time until the one after it. After the last step the alarm waits
+// once more at the start rate, so a move that follows right away does not start faster than the motor can. A seek
+// reads the optofork after every step, which ties the edge to an exact step at any speed, and slows down from there.
+static int64_t stepAlarm(alarm_id_t id, void *user_data) {
+    if (true == move.cancel) {
+        /* slow down over as many steps as it took to get to this speed */
+        int stop = move.done + rampIndex(move.done);
+        move.cancel = false;
+        if (stop < move.total) {
+            move.total = stop;
+            move.cancelled = true;
         }
-        revolution_counter++;
-        if (--row <= -1) {
-            row = 7;
+    }
+    if (move.done >= move.total) {
+        if (true == move.cancelled) {
+            return motionFinish(MOTION_CANCELLED);
         }
-        sleep_ms(2);
+        return motionFinish(true == move.seek && 0 > move.edge ? MOTION_NOT_FOUND : MOTION_DONE);
+    }
+    row = (row + move.direction) & 7;
+    gpio_put_masked(COIL_MASK, turning_sequence[row]);
+    revolution_counter -= move.direction;
+    int step = move.done++;
+    bool level = gpio_get(OPTOFORK);
+    if (0 > move.direction && true == move.level && false == level) {
+        int lost = wheelEdge();
+        if (true == move.seek && 0 > move.edge) {
+            move.edge = move.done;
+            move.total = move.done + rampIndex(step);
+        } else if (true == move.track && 0 != lost) {
+            /* a move cut short still slows down first; the next one starts from the corrected position */
+            int stop = move.done + rampIndex(step);
+            move.total = move.total + lost > stop ? move.total + lost : stop;
+        }
+    }
+    move.level = level;
+    /* a move made longer on the way speeds up again no faster than the ramp */
+    int ramp = rampIndex(step);
+    move.ramp = ramp > move.ramp + 1 ? move.ramp + 1 : ramp;
+    /* negative: timed from when this alarm was due, so the latency of the callback does not add up */
+    return -(int64_t) ramp_us[move.ramp];
+}
+
+static bool motionStart(int steps, int ramp_limit, bool seek, bool track, motion_callback_t callback,
+                        void *user_data) {
+    if (MOTION_RUNNING == move.status) {
+        return false;
+    }
+    move.direction = 0 > steps ? 1 : -1;
+    move.total = 0 > steps ? -steps : steps;
+    move.ramp_limit = ramp_limit;
+    move.seek = seek;
+    move.track = track;
+    move.level = gpio_get(OPTOFORK);
+    move.edge = -1;
+    move.ramp = -1;
+    move.done = 0;
+    move.cancel = false;
+    move.cancelled = false;
+    move.callback = callback;
+    move.user_data = user_data;
+    move.status = MOTION_RUNNING;
+    if (0 > add_alarm_in_us(0, stepAlarm, NULL, true)) {
+        /* no alarm left for the motor; may run in the timer interrupt, so only the return value tells */
+        move.status = MOTION_IDLE;
+        return false;
+    }
+    return true;
+}
+
+// Starts turning the wheel by steps, clockwise if positive, with the speed profile of the step engine. Returns false
+// if a move is running already. callback, if given, runs in the timer interrupt when the move has ended.
+bool moveStepsAsync(int steps, motion_callback_t callback, void *user_data) {
+    return motionStart(steps, ramp_length, false, false, callback, user_data);
+}
+
+// Turns clockwise until the optofork sees the slot, or for at most max_steps, and reports the steps to the edge with
+// MOTION_DONE or ends with MOTION_NOT_FOUND. A slow seek stays at the start rate and stops on the step of the edge; a
+// fast one uses the whole speed profile and slows down past the edge, motionStatus() tells how far it went.
+bool seekOptoforkAsync(int max_steps, bool fast, motion_callback_t callback, void *user_data) {
+    return motionStart(max_steps, true == fast ? ramp_length : 1, true, false, callback, user_data);
+}
+
+// The state of the last move, and the steps it has taken so far if steps is not NULL.
+enum MotionStatus motionStatus(int *steps) {
+    if (NULL != steps) {
+        *steps = move.done;
+    }
+    return move.status;
+}
+
+// Stops the running move, slowing down first so no step is lost. It ends with MOTION_CANCELLED.
+void motionCancel() {
+    if (MOTION_RUNNING == move.status) {
+        move.cancel = true;
+    }
+}
+
+// Waits for the running move to end.
+static enum MotionStatus motionWait() {
+    while (MOTION_RUNNING == move.status) {
+        tight_loop_contents();
+    }
+    return move.status;
+}
+
+enum CalibrationStage {
+    CALIBRATION_SEEK,           // fast to the edge, past it while slowing down
+    CALIBRATION_NEAR,           // to APPROACH_STEPS before the edge: back after a seek, on by a known revolution
+    CALIBRATION_APPROACH,       // slowly onto the edge
+    CALIBRATION_ALIGN           // from the edge to compartment 0 over the hole
+};
+
+static void calibrationNext(enum MotionStatus status, int steps, void *user_data);
+
+static void calibrationEnd(enum MotionStatus status);
+
+static void calibrationMove(enum CalibrationStage stage, int steps) {
+    bool started;
+    calibration.stage = stage;
+    calibration.direction = 0 > steps ? -1 : 1;
+    if (CALIBRATION_SEEK == stage || CALIBRATION_APPROACH == stage) {
+        started = seekOptoforkAsync(steps, CALIBRATION_SEEK == stage, calibrationNext, NULL);
+    } else {
+        started = moveStepsAsync(steps, calibrationNext, NULL);
+    }
+    if (false == started) {
+        calibrationEnd(MOTION_CANCELLED);
     }
 }
 
-void realignMotor() {//If reboot occurs during motor turn, realigns motor back to last stored position.
-    int stored_position = i2cReadByte(STEPPER_POSITION_ADDRESS) * 4;
-    while (0 != stored_position--) {
-        runMotorAntiClockwise(1);
+static void calibrationEnd(enum MotionStatus status) {
+    calibrated = MOTION_DONE == status;
+    if (true == calibrated) {
+        /* aligned ALIGNMENT steps before the edge the revolution was counted to */
+        revolution_counter = calibration_count - ALIGNMENT;
+        wheel_known = true;
+    }
+    calibration.callback(status, calibration_count, calibration.user_data);
+}
+
+// Calibration as a chain of moves. A fast seek finds the slot and a slow approach from just before it pins down the
+// edge; that edge is the reference. The revolution to the next edge is measured the same way, or, with the steps per
+// revolution of an earlier calibration, covered in one fast move to just before the edge, where the slow approach only
+// confirms the count. If it does not, the revolution is measured from scratch. Runs in the timer interrupt, the
+// callback of the calibration tells the result.
+static void calibrationNext(enum MotionStatus status, int steps, void *user_data) {
+    int taken;
+    motionStatus(&taken);
+    calibration.position += calibration.direction * taken;
+
+    switch (calibration.stage) {
+        case CALIBRATION_SEEK:
+            if (MOTION_DONE != status) {
+                calibrationEnd(status);
+            } else {
+                calibrationMove(CALIBRATION_NEAR, -(taken - steps + APPROACH_STEPS));
+            }
+            break;
+        case CALIBRATION_NEAR:
+            calibrationMove(CALIBRATION_APPROACH, 2 * APPROACH_STEPS);
+            break;
+        case CALIBRATION_APPROACH:
+            if (MOTION_DONE != status) {
+                if (false == calibration.reference || 0 == calibration.expected) {
+                    calibrationEnd(status);
+                    return;
+                }
+                calibration.reference = false;
+                calibration.expected = 0;
+                calibrationMove(CALIBRATION_SEEK, SEEK_LIMIT);
+            } else if (false == calibration.reference) {
+                calibration.reference = true;
+                calibration.position = 0;
+                if (0 != calibration.expected) {
+                    calibrationMove(CALIBRATION_NEAR, calibration.expected - APPROACH_STEPS);
+                } else {
+                    calibrationMove(CALIBRATION_SEEK, SEEK_LIMIT);
+                }
+            } else {
+                calibration_count = calibration.position;
+                calibrationMove(CALIBRATION_ALIGN, -ALIGNMENT);
+            }
+            break;
+        case CALIBRATION_ALIGN:
+            calibrationEnd(status);
+            break;
+    }
+}
+
+// Calibrates the motor by counting the steps of one revolution between two falling edges of the optofork, then aligns
+// the wheel, all in the background. expected is the count of an earlier calibration to check, or 0. callback gets
+// MOTION_DONE and the steps per revolution when the wheel is aligned.
+bool calibrateMotorAsync(int expected, motion_callback_t callback, void *user_data) {
+    if (MOTION_RUNNING == motionStatus(NULL)) {
+        return false;
+    }
+    calibrated = false;
+    wheel_known = false;
+    calibration.expected = expected;
+    calibration.reference = false;
+    calibration.position = 0;
+    calibration.callback = callback;
+    calibration.user_data = user_data;
+    calibrationMove(CALIBRATION_SEEK, SEEK_LIMIT);
+    return true;
+}
+
+// Turns the wheel clockwise from where it is to the given compartment, 0 being the one over the hole after a
+// calibration. Steps the optofork shows to have been lost on the way are added to the move.
+bool moveToCompartmentAsync(int compartment, motion_callback_t callback, void *user_data) {
+    int steps = wheelOffset(compartmentPosition(compartment) - ALIGNMENT - revolution_counter);
+    /* a wheel that is a few steps past the compartment already stays there rather than going round once more */
+    return motionStart(0 < steps ? steps : 0, ramp_length, false, true, callback, user_data);
+}
+
+// Tells the motor which compartment is over the hole, for a wheel that has not been calibrated since the boot.
+void wheelAtCompartment(int compartment) {
+    if (0 < calibration_count) {
+        revolution_counter = wheelWrap(compartmentPosition(compartment) - ALIGNMENT);
+        wheel_known = true;
+    }
+}
+
+void wheelGetStats(wheel_stats *stats) {
+    *stats = wheel;
+}
+
+void runMotorAntiClockwise(int times) {//Rotates stepper motor anticlockwise by the number of integer passed as parameter.
+    if (true == moveStepsAsync(-times, NULL, NULL)) {
+        motionWait();
+    }
+}
+
+void runMotorClockwise(int times) {//Rotates stepper motor clockwise by the number of integer passed as parameter.
+    if (true == moveStepsAsync(times, NULL, NULL)) {
+        motionWait();
+    }
+}
+
+// Clockwise steps the wheel has turned past the given compartment.
+int wheelStepsPast(int compartment) {
+    return wheelWrap(ALIGNMENT + revolution_counter - compartmentPosition(compartment));
+}
+
+// If reboot occurs during motor turn, puts the wheel back into the step count instead of turning it back: the turn to
+// compartment started at the one before, and the position journal holds how far it got, which can only lag behind
+// the wheel. The optofork tells whether the wheel stopped in the slot, past the edge the count may not have reached.
+// The next move to the compartment finishes the turn from there, the shorter way.
+void realignMotor(int compartment) {
+    int turn = wheelWrap(compartmentPosition(compartment) - compartmentPosition(compartment - 1));
+    int steps = positionRead();
+    wheelAtCompartment(compartment - 1);
+    revolution_counter = wheelWrap(revolution_counter + (steps < turn ? steps : turn));
+    if (false == gpio_get(OPTOFORK) && revolution_counter > calibration_count / 2) {
+        revolution_counter = 0;
     }
 }
 
@@ -92,12 +416,8 @@ void optoforkInit() {
     gpio_pull_up(OPTOFORK);
 }
 
-void optoFallingEdge() { //In case of optofork falling edge, fallingEdge flag is set to true. Sets the calibration_count and resets the revolution_counter to zero.
+void optoFallingEdge() { //In case of optofork falling edge, fallingEdge flag is set to true.
     fallingEdge = true;
-    if (false == calibrated) {
-        calibration_count = revolution_counter;
-    }
-    revolution_counter = 0;
 }
 
 void piezoInit() {
@@ -10,6 +10,42 @@
 #define COMPARTMENTS 8
 #define SLEEP_BETWEEN 30000
 
+/*  STEP ENGINE: moves in half steps with a trapezoidal speed profile; the defaults keep a 28BYJ-48 at 5 V in step  */
+#ifndef STEPPER_START_RATE
+#define STEPPER_START_RATE 500          // steps/s a move starts and ends at, the rate the motor starts at from rest
+#endif
+#ifndef STEPPER_MAX_RATE
+#define STEPPER_MAX_RATE 1000           // steps/s
+#endif
+#ifndef STEPPER_ACCELERATION
+#define STEPPER_ACCELERATION 4000       // steps/s^2, for speeding up and slowing down
+#endif
+#define STEPPER_RAMP_STEPS 256          // longest ramp the profile may need
+#ifndef STEPPER_HOLD
+#define STEPPER_HOLD 0                  // 1 keeps the coils energized between moves; the gears hold the wheel anyway
+#endif
+#define SEEK_LIMIT 5120                 // steps a seek turns without finding the optofork, 1.25 revolutions
+#define APPROACH_STEPS 32               // steps before the optofork edge the slow approach of a calibration starts
+
+enum MotionStatus {
+    MOTION_IDLE,            // no move since boot
+    MOTION_RUNNING,
+    MOTION_DONE,
+    MOTION_CANCELLED,
+    MOTION_NOT_FOUND        // a seek turned as far as it was allowed to without seeing the optofork
+};
+
+// called from the timer interrupt when a move has ended, with the steps it took
+typedef void (*motion_callback_t)(enum MotionStatus status, int steps, void *user_data);
+
+typedef struct wheel_stats {
+    uint32_t edges;             // optofork edges passed while the position of the wheel was known
+    uint32_t corrections;       // edges that found the wheel somewhere else than the counted steps put it
+    uint32_t lost_steps;        // sum of the corrections
+    int last_error;             // steps the wheel was behind at the last edge, negative if it was ahead
+    int last_revolution;        // steps counted between the last two edges
+} wheel_stats;
+
 /*  OPTOFORK  */
 #define OPTOFORK 28
 
@@ -18,8 +54,16 @@
 #define BLINK_TIMES 5
 
 void stepperMotorInit();
-void calibrateMotor();
-void realignMotor();
+bool moveStepsAsync(int steps, motion_callback_t callback, void *user_data);
+bool seekOptoforkAsync(int max_steps, bool fast, motion_callback_t callback, void *user_data);
+enum MotionStatus motionStatus(int *steps);
+void motionCancel();
+bool calibrateMotorAsync(int expected, motion_callback_t callback, void *user_data);
+bool moveToCompartmentAsync(int compartment, motion_callback_t callback, void *user_data);
+void wheelAtCompartment(int compartment);
+void wheelGetStats(wheel_stats *stats);
+void realignMotor(int compartment);
+int wheelStepsPast(int compartment);
 void runMotorAntiClockwise(int times);
 void runMotorClockwise(int times);
 void optoforkInit();
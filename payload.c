@@ -0,0 +1,62 @@
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "payload.h"
+
+static const char *event_names[EVENT_COUNT] = {"clean-boot",
+                                               "calibrated",
+                                               "power-off-idle",
+                                               "power-off-turning",
+                                               "all-dispensed",
+                                               "boot-after-calibration",
+                                               "waiting-calibration",
+                                               "watchdog-reboot",
+                                               "pill-dispensed",
+                                               "pill-missed"};
+
+// Writes the PAYLOAD_SIZE bytes of event to out and returns their number.
+size_t payloadEncode(const payload_event *event, uint8_t *out) {
+    out[0] = (uint8_t) (PAYLOAD_VERSION << 4 | (event->event & 0x0f));
+    out[1] = event->day;
+    out[2] = event->pills_left;
+    out[3] = event->flags;
+    out[4] = (uint8_t) (event->sequence >> 8);
+    out[5] = (uint8_t) event->sequence;
+    return PAYLOAD_SIZE;
+}
+
+// Returns false for payloads of another size or version, or with an unknown event code.
+bool payloadDecode(const uint8_t *data, size_t size, payload_event *event) {
+    if (PAYLOAD_SIZE != size || PAYLOAD_VERSION != data[0] >> 4 || EVENT_COUNT <= (data[0] & 0x0f)) {
+        return false;
+    }
+    event->event = data[0] & 0x0f;
+    event->day = data[1];
+    event->pills_left = data[2];
+    event->flags = data[3];
+    event->sequence = (uint16_t) (data[4] << 8 | data[5]);
+    return true;
+}
+
+// Decodes a payload given as hex digits, as passed to AT+MSGHEX or shown by a network server.
+bool payloadDecodeHex(const char *hex, payload_event *event) {
+    uint8_t data[PAYLOAD_SIZE];
+    size_t size = 0;
+
+    while (size < PAYLOAD_SIZE && isxdigit((unsigned char) hex[0]) && isxdigit((unsigned char) hex[1])) {
+        char digits[3] = {hex[0], hex[1], '\0'};
+        data[size++] = (uint8_t) strtoul(digits, NULL, 16);
+        hex += 2;
+    }
+    return '\0' == *hex && payloadDecode(data, size, event);
+}
+
+const char *payloadEventName(uint8_t event) {
+    return event < EVENT_COUNT ? event_names[event] : "unknown";
+}
+
+// Formats event as text, e.g. "#3 pill-dispensed day=2 left=5 flags=0x02". Returns the length like snprintf.
+int payloadFormat(const payload_event *event, char *out, size_t size) {
+    return snprintf(out, size, "#%u %s day=%u left=%u flags=0x%02x", event->sequence, payloadEventName(event->event),
+                    event->day, event->pills_left, event->flags);
+}
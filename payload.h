@@ -0,0 +1,54 @@
+#ifndef PAYLOAD_H
+#define PAYLOAD_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Binary uplink payload, sent with AT+MSGHEX instead of the ASCII log sentence:
+ *
+ *   byte 0     version (high nibble) | event code (low nibble)
+ *   byte 1     day, i.e. compartments moved
+ *   byte 2     pills left
+ *   byte 3     flags (PAYLOAD_FLAG_*)
+ *   byte 4..5  sequence number, big endian, counts uplinks; kept in the device state, so it carries on across resets
+ *
+ * The decoder is shared with host tools so both sides always agree on the format.
+ */
+#define PAYLOAD_VERSION 1
+#define PAYLOAD_SIZE 6
+
+#define PAYLOAD_FLAG_WATCHDOG   0x01    // the last reset was caused by the watchdog
+#define PAYLOAD_FLAG_CALIBRATED 0x02    // the wheel has been calibrated
+
+// Event codes 0..7 are the fixed log messages in the same order as fixed_msg[] in main.c.
+enum PayloadEvent {
+    EVENT_CLEAN_BOOT,
+    EVENT_CALIBRATED,
+    EVENT_POWER_OFF_IDLE,
+    EVENT_POWER_OFF_TURNING,
+    EVENT_ALL_DISPENSED,
+    EVENT_BOOT_AFTER_CALIBRATION,
+    EVENT_WAITING_CALIBRATION,
+    EVENT_WATCHDOG_REBOOT,
+    EVENT_PILL_DISPENSED,
+    EVENT_PILL_MISSED,
+    EVENT_COUNT
+};
+
+typedef struct payload_event_ {
+    uint8_t event;
+    uint8_t day;
+    uint8_t pills_left;
+    uint8_t flags;
+    uint16_t sequence;
+} payload_event;
+
+size_t payloadEncode(const payload_event *event, uint8_t *out);
+bool payloadDecode(const uint8_t *data, size_t size, payload_event *event);
+bool payloadDecodeHex(const char *hex, payload_event *event);
+const char *payloadEventName(uint8_t event);
+int payloadFormat(const payload_event *event, char *out, size_t size);
+
+#endif
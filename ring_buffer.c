@@ -1,44 +1,101 @@
+#include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include "ring_buffer.h"
 
 void rb_init(ring_buffer *rb, uint8_t *buffer, int size) {
+    // masking the free running indices only works for power of two sizes
+    assert(size > 0 && 0 == (size & (size - 1)));
     rb->buffer = buffer;
-    rb->size = size;
-    rb->head = 0;
-    rb->tail = 0;
+    rb->mask = size - 1;
+    rb->overflows = 0;
+    atomic_init(&rb->head, 0);
+    atomic_init(&rb->tail, 0);
 }
 
 bool rb_full(ring_buffer *rb) {
-    return (rb -> head +1) % rb->size == rb->tail;
+    return rb_count(rb) > rb->mask;
 }
 
 bool rb_empty(ring_buffer *rb) {
-    return rb->head == rb->tail;
+    return 0 == rb_count(rb);
+}
+
+size_t rb_count(ring_buffer *rb) {
+    uint32_t head = atomic_load_explicit(&rb->head, memory_order_acquire);
+    uint32_t tail = atomic_load_explicit(&rb->tail, memory_order_acquire);
+    return head - tail;
+}
 
+uint32_t rb_overflows(ring_buffer *rb) {
+    return rb->overflows;
 }
 
 bool rb_put(ring_buffer *rb, uint8_t data) {
-    // calculate new head (position where to store the value)
-    int nh =(rb-> head +1) % rb->size;
-    // calculate new head (position where to store the value)
-    if (nh == rb->tail) return false;
+    uint32_t head = atomic_load_explicit(&rb->head, memory_order_relaxed);
+    // acquire pairs with the consumer's release: the slot we are about to overwrite has been read
+    uint32_t tail = atomic_load_explicit(&rb->tail, memory_order_acquire);
+    if (head - tail > rb->mask) {
+        rb->overflows++;
+        return false;
+    }
 
-    rb -> buffer[rb->head] = data;
-    rb -> head = nh;
+    rb->buffer[head & rb->mask] = data;
+    // release publishes the byte before the consumer can see the new head
+    atomic_store_explicit(&rb->head, head + 1, memory_order_release);
     return true;
 }
 
 uint8_t rb_get(ring_buffer *rb) {
-    uint8_t value = rb -> buffer[rb->tail];
-    if(rb -> size == rb->tail) {
-        rb->tail = (rb->tail + 1) % rb->size;
-    }
+    uint32_t tail = atomic_load_explicit(&rb->tail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&rb->head, memory_order_acquire);
+    if (head == tail) return 0;
+
+    uint8_t value = rb->buffer[tail & rb->mask];
+    atomic_store_explicit(&rb->tail, tail + 1, memory_order_release);
     return value;
 }
+
+// Stores as much of data as fits with at most two memcpy calls. Returns the number of bytes stored.
+size_t rb_put_span(ring_buffer *rb, const uint8_t *data, size_t length) {
+    uint32_t head = atomic_load_explicit(&rb->head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&rb->tail, memory_order_acquire);
+    size_t space = rb->mask + 1 - (head - tail);
+    size_t n = length < space ? length : space;
+    size_t offset = head & rb->mask;
+    size_t first = rb->mask + 1 - offset;
+    if (first > n) first = n;
+
+    memcpy(&rb->buffer[offset], data, first);
+    memcpy(rb->buffer, data + first, n - first);
+    atomic_store_explicit(&rb->head, head + (uint32_t) n, memory_order_release);
+    rb->overflows += length - n;
+    return n;
+}
+
+// Takes up to length bytes with at most two memcpy calls. Returns the number of bytes taken.
+size_t rb_get_span(ring_buffer *rb, uint8_t *data, size_t length) {
+    uint32_t tail = atomic_load_explicit(&rb->tail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&rb->head, memory_order_acquire);
+    size_t available = head - tail;
+    size_t n = length < available ? length : available;
+    size_t offset = tail & rb->mask;
+    size_t first = rb->mask + 1 - offset;
+    if (first > n) first = n;
+
+    memcpy(data, &rb->buffer[offset], first);
+    memcpy(data + first, rb->buffer, n - first);
+    atomic_store_explicit(&rb->tail, tail + (uint32_t) n, memory_order_release);
+    return n;
+}
+
+// Rounds size up to the next power of two.
 void rb_alloc(ring_buffer *rb, int size) {
-    uint8_t *buffer = calloc(size, sizeof(uint8_t));
-    rb_init(rb, buffer, size);
+    int capacity = 1;
+    while (capacity < size) capacity <<= 1;
+    uint8_t *buffer = calloc(capacity, sizeof(uint8_t));
+    rb_init(rb, buffer, capacity);
 }
 void rb_free(ring_buffer *rb) {
     free(rb->buffer);
@@ -3,11 +3,19 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdatomic.h>
 
+/*
+ * Lock-free single-producer/single-consumer byte ring. One side (e.g. an ISR) only calls the put functions, the other
+ * only the get functions. head and tail run freely and are masked on access, so the size must be a power of two and
+ * all of it is usable. Bytes a put could not store are counted in overflows.
+ */
 typedef struct  {
-    int head;
-    int tail;
-    int size;
+    atomic_uint head;       // written by the producer only
+    atomic_uint tail;       // written by the consumer only
+    uint32_t mask;
+    uint32_t overflows;     // written by the producer only
     uint8_t *buffer;
 } ring_buffer;
 
@@ -17,7 +25,12 @@ bool rb_full(ring_buffer *rb);
 bool rb_put(ring_buffer *rb, uint8_t data);
 uint8_t rb_get(ring_buffer *rb);
 
+size_t rb_count(ring_buffer *rb);
+size_t rb_put_span(ring_buffer *rb, const uint8_t *data, size_t length);
+size_t rb_get_span(ring_buffer *rb, uint8_t *data, size_t length);
+uint32_t rb_overflows(ring_buffer *rb);
+
 void rb_alloc(ring_buffer *rb, int size);
 void rb_free(ring_buffer *rb);
 
-#endif //UART_IRQ_RING_BUFFER_H
\ No newline at end of file
+#endif //UART_IRQ_RING_BUFFER_H
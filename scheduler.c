@@ -0,0 +1,194 @@
+#include <stdio.h>
+#include "pico/stdlib.h"
+#include "hardware/sync.h"
+#include "scheduler.h"
+
+/* Tasks run one at a time in the main loop and always to the end, so they share data with each other without locks.
+ * Interrupt handlers only post events; the events run their task in the order they were posted, before any timed
+ * task is looked at. A task is timed by schedulerRunIn() or schedulerRunAt() and runs once when its time has come. */
+typedef struct task {
+    const char *name;
+    task_fn_t fn;
+    void *context;
+    bool timed;
+    absolute_time_t due;
+    task_stats stats;
+} task;
+
+typedef struct event {
+    uint8_t task;
+    uint32_t posted_us;
+} event;
+
+static task tasks[SCHEDULER_MAX_TASKS];
+static int task_count;
+
+static event queue[SCHEDULER_QUEUE_SIZE];
+static volatile uint32_t queue_head;        // written by schedulerPost() only
+static volatile uint32_t queue_tail;        // written by schedulerRun() only
+static scheduler_stats scheduler;
+
+static volatile alarm_id_t wake_alarm;      // wakes the core for the next timed task, 0 once it has fired
+static absolute_time_t wake_at;
+
+// Registers fn as a task and returns its id, or -1 if the table is full. Tasks are added before schedulerRun().
+int schedulerAddTask(const char *name, task_fn_t fn, void *context) {
+    if (SCHEDULER_MAX_TASKS == task_count) {
+        return -1;
+    }
+    tasks[task_count] = (task) {.name = name, .fn = fn, .context = context, .stats.name = name};
+    scheduler.tasks = ++task_count;
+    return task_count - 1;
+}
+
+// Queues an event for task. Safe to call from interrupt handlers and tasks; returns false if the queue is full.
+bool schedulerPost(int task) {
+    uint32_t status = save_and_disable_interrupts();
+    uint32_t depth = queue_head - queue_tail;
+    bool queued = depth < SCHEDULER_QUEUE_SIZE;
+    if (true == queued) {
+        queue[queue_head % SCHEDULER_QUEUE_SIZE] = (event) {.task = (uint8_t) task, .posted_us = time_us_32()};
+        queue_head++;
+        scheduler.events++;
+        if (depth + 1 > scheduler.max_depth) {
+            scheduler.max_depth = depth + 1;
+        }
+    } else {
+        scheduler.dropped++;
+    }
+    restore_interrupts(status);
+    return queued;
+}
+
+// Runs task once at, or as soon after it as the tasks before it let. A task timed already is moved. Tasks only.
+void schedulerRunAt(int task, absolute_time_t at) {
+    tasks[task].due = at;
+    tasks[task].timed = true;
+}
+
+void schedulerRunIn(int task, uint32_t ms) {
+    schedulerRunAt(task, make_timeout_time_ms(ms));
+}
+
+void schedulerCancel(int task) {
+    tasks[task].timed = false;
+}
+
+bool schedulerTimed(int task) {
+    return tasks[task].timed;
+}
+
+static void taskRun(task *t) {
+    uint64_t start = time_us_64();
+    t->fn(t->context);
+    uint32_t elapsed = (uint32_t) (time_us_64() - start);
+    t->stats.runs++;
+    t->stats.total_us += elapsed;
+    if (elapsed > t->stats.max_us) {
+        t->stats.max_us = elapsed;
+    }
+}
+
+// Takes the oldest event off the queue; returns false if there is none.
+static bool eventNext(event *next) {
+    uint32_t status = save_and_disable_interrupts();
+    bool found = queue_tail != queue_head;
+    if (true == found) {
+        *next = queue[queue_tail % SCHEDULER_QUEUE_SIZE];
+        queue_tail++;
+    }
+    restore_interrupts(status);
+    return found;
+}
+
+// Returns the timed task due first, or NULL if no task is timed.
+static task *timedNext() {
+    task *next = NULL;
+    for (int i = 0; i < task_count; i++) {
+        if (true == tasks[i].timed && (NULL == next || absolute_time_diff_us(next->due, tasks[i].due) < 0)) {
+            next = &tasks[i];
+        }
+    }
+    return next;
+}
+
+// The alarm only has to end the sleep of schedulerRun(), which then finds the task due.
+static int64_t wakeAlarm(alarm_id_t id, void *context) {
+    wake_alarm = 0;
+    return 0;
+}
+
+// Arms the alarm for due unless it is armed for it already. Returns false if due has passed.
+static bool wakeAt(absolute_time_t due) {
+    if (0 < wake_alarm && to_us_since_boot(wake_at) == to_us_since_boot(due)) {
+        return true;
+    }
+    if (0 < wake_alarm) {
+        cancel_alarm(wake_alarm);
+    }
+    wake_at = due;
+    wake_alarm = add_alarm_at(due, wakeAlarm, NULL, false);
+    return 0 < wake_alarm;
+}
+
+// The main loop. Runs the task of every event, then the timed tasks that are due, and sleeps until the next interrupt
+// or timed task when there is nothing to do. Never returns.
+void schedulerRun() {
+    while (true) {
+        event next;
+        if (true == eventNext(&next)) {
+            uint32_t latency = time_us_32() - next.posted_us;
+            if (latency > scheduler.max_latency_us) {
+                scheduler.max_latency_us = latency;
+            }
+            taskRun(&tasks[next.task]);
+            continue;
+        }
+
+        task *timed = timedNext();
+        if (NULL != timed && absolute_time_diff_us(get_absolute_time(), timed->due) <= 0) {
+            timed->timed = false;
+            taskRun(timed);
+            continue;
+        }
+
+        uint64_t idle_start = time_us_64();
+#if SCHEDULER_IDLE_SLEEP
+        /* no tick: the core sleeps until an interrupt, the alarm of the next timed task among them. The queue is
+         * looked at again with the interrupts masked: an event posted or an alarm due after that leaves its
+         * interrupt pending, which ends the WFI at once and runs the handler when the interrupts are restored. */
+        uint32_t status = save_and_disable_interrupts();
+        if (queue_tail == queue_head && (NULL == timed || true == wakeAt(timed->due))) {
+            __wfi();
+        }
+        restore_interrupts(status);
+#else
+        busy_wait_us(SCHEDULER_POLL_US);
+#endif
+        scheduler.idle_us += time_us_64() - idle_start;
+    }
+}
+
+void schedulerGetStats(scheduler_stats *stats) {
+    *stats = scheduler;
+}
+
+// Copies the counters of task; returns false if there is no such task.
+bool schedulerGetTaskStats(int task, task_stats *stats) {
+    if (0 > task || task >= task_count) {
+        return false;
+    }
+    *stats = tasks[task].stats;
+    return true;
+}
+
+void schedulerPrintStats() {
+    printf("Scheduler: %lu events, %lu dropped, queue depth %lu, latency %lu us, idle %llu ms\n",
+           (unsigned long) scheduler.events, (unsigned long) scheduler.dropped, (unsigned long) scheduler.max_depth,
+           (unsigned long) scheduler.max_latency_us, (unsigned long long) (scheduler.idle_us / 1000));
+    for (int i = 0; i < task_count; i++) {
+        const task_stats *stats = &tasks[i].stats;
+        printf("  %-12s %6lu runs %8lu us total %6lu us max\n", stats->name, (unsigned long) stats->runs,
+               (unsigned long) stats->total_us, (unsigned long) stats->max_us);
+    }
+}
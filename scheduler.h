@@ -0,0 +1,45 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "pico/time.h"
+
+/*  SCHEDULER: run-to-completion tasks, started by events from interrupts or at a time  */
+#define SCHEDULER_MAX_TASKS 12
+#define SCHEDULER_QUEUE_SIZE 16         // events waiting for their task, a power of two
+#ifndef SCHEDULER_IDLE_SLEEP
+#define SCHEDULER_IDLE_SLEEP 1          // 0 keeps the core awake between tasks, polling every SCHEDULER_POLL_US
+#endif
+#define SCHEDULER_POLL_US 1000
+
+typedef void (*task_fn_t)(void *context);
+
+typedef struct task_stats {
+    const char *name;
+    uint32_t runs;
+    uint32_t total_us;                  // sum of the run times
+    uint32_t max_us;
+} task_stats;
+
+typedef struct scheduler_stats {
+    int tasks;
+    uint32_t events;                    // events posted
+    uint32_t dropped;                   // events lost to a full queue
+    uint32_t max_depth;                 // most events waiting at once
+    uint32_t max_latency_us;            // longest wait of an event for its task
+    uint64_t idle_us;                   // time spent waiting for the next event or timed task
+} scheduler_stats;
+
+int schedulerAddTask(const char *name, task_fn_t fn, void *context);
+bool schedulerPost(int task);
+void schedulerRunIn(int task, uint32_t ms);
+void schedulerRunAt(int task, absolute_time_t at);
+void schedulerCancel(int task);
+bool schedulerTimed(int task);
+void schedulerRun();
+void schedulerGetStats(scheduler_stats *stats);
+bool schedulerGetTaskStats(int task, task_stats *stats);
+void schedulerPrintStats();
+
+#endif
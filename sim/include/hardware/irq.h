@@ -0,0 +1,19 @@
+#ifndef SIM_HARDWARE_IRQ_H
+#define SIM_HARDWARE_IRQ_H
+
+#include "pico.h"
+
+#define TIMER_IRQ_0   0
+#define IO_IRQ_BANK0 13
+#define I2C0_IRQ     23
+#define UART0_IRQ    20
+#define UART1_IRQ    21
+#define NUM_IRQS     32
+
+typedef void (*irq_handler_t)(void);
+
+void irq_set_enabled(uint num, bool enabled);
+bool irq_is_enabled(uint num);
+void irq_set_exclusive_handler(uint num, irq_handler_t handler);
+
+#endif
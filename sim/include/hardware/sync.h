@@ -0,0 +1,18 @@
+#ifndef SIM_HARDWARE_SYNC_H
+#define SIM_HARDWARE_SYNC_H
+
+#include "pico.h"
+
+/* Interrupt handlers only run while time moves on, never in the middle of firmware code, so there is nothing to mask. */
+static inline uint32_t save_and_disable_interrupts(void) {
+    return 0;
+}
+
+static inline void restore_interrupts(uint32_t status) {
+    (void) status;
+}
+
+/* Sleeps until the next event of the simulator; every one of them stands for an interrupt, masked or not. */
+void __wfi(void);
+
+#endif
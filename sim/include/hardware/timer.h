@@ -0,0 +1,16 @@
+#ifndef SIM_HARDWARE_TIMER_H
+#define SIM_HARDWARE_TIMER_H
+
+#include "pico.h"
+
+typedef struct {
+    volatile uint32_t dbgpause;
+} timer_hw_t;
+
+extern timer_hw_t sim_timer_hw;
+#define timer_hw (&sim_timer_hw)
+
+uint32_t time_us_32(void);
+uint64_t time_us_64(void);
+
+#endif
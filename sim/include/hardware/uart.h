@@ -0,0 +1,33 @@
+#ifndef SIM_HARDWARE_UART_H
+#define SIM_HARDWARE_UART_H
+
+#include "pico.h"
+#include "hardware/irq.h"
+
+#define UART_UARTIMSC_RXIM_LSB 4
+#define UART_UARTIMSC_TXIM_LSB 5
+#define UART_UARTIMSC_RTIM_LSB 6
+
+/* Register block seen by the firmware. Writes to dr are picked up by the simulator on the next uart_* call or when
+ * the interrupt handler returns, since a plain store cannot trap on the host. */
+typedef struct {
+    volatile uint32_t dr;
+    volatile uint32_t imsc;
+} uart_hw_t;
+
+typedef struct uart_inst uart_inst_t;
+
+extern uart_inst_t sim_uart0_inst, sim_uart1_inst;
+#define uart0 (&sim_uart0_inst)
+#define uart1 (&sim_uart1_inst)
+
+uint uart_init(uart_inst_t *uart, uint baudrate);
+uint uart_get_index(uart_inst_t *uart);
+uart_hw_t *uart_get_hw(uart_inst_t *uart);
+void uart_set_irq_enables(uart_inst_t *uart, bool rx_has_data, bool tx_needs_data);
+bool uart_is_readable(uart_inst_t *uart);
+bool uart_is_writable(uart_inst_t *uart);
+char uart_getc(uart_inst_t *uart);
+void uart_putc_raw(uart_inst_t *uart, char c);
+
+#endif
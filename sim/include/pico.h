@@ -0,0 +1,15 @@
+/*
+ * Host simulator stand-in for the pico-sdk <pico.h> umbrella header. Only the parts the firmware uses are provided.
+ */
+#ifndef SIM_PICO_H
+#define SIM_PICO_H
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "pico/types.h"
+#include "pico/error.h"
+
+#endif
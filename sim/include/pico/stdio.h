@@ -0,0 +1,9 @@
+#ifndef SIM_PICO_STDIO_H
+#define SIM_PICO_STDIO_H
+
+#include <stdio.h>
+#include "pico.h"
+
+bool stdio_init_all(void);
+
+#endif
@@ -0,0 +1,13 @@
+#ifndef SIM_PICO_STDLIB_H
+#define SIM_PICO_STDLIB_H
+
+#include "pico.h"
+#include "pico/stdio.h"
+#include "pico/time.h"
+#include "hardware/gpio.h"
+#include "hardware/uart.h"
+
+/* On the RP2040 this is an empty hint inside busy loops; the simulator uses it to let simulated time pass. */
+void tight_loop_contents(void);
+
+#endif
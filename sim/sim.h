@@ -0,0 +1,158 @@
+/*
+ * Host simulator for the pill dispenser firmware.
+ *
+ * The firmware sources are compiled unchanged against the pico-sdk stand-in headers in sim/include. Those calls land
+ * in the models below: a clock with an event queue, GPIO and PWM, the 24LC256 EEPROM behind i2c0, the PL011 UART with
+ * a LoRa-E5 modem on the other end and the stepper wheel with its optofork and piezo sensor.
+ */
+#ifndef SIM_H
+#define SIM_H
+
+#include <stdio.h>
+#include "pico.h"
+
+#define SIM_EXIT_REBOOT 100
+
+/////////////////////////////////////////////////////
+//                 CLOCK AND EVENTS                //
+/////////////////////////////////////////////////////
+
+typedef void (*sim_event_fn)(void *arg);
+typedef uint32_t sim_event_id;
+
+#define SIM_NO_EVENT 0
+
+void sim_time_init(bool realtime);
+uint64_t sim_time_us(void);
+void sim_time_skip_us(uint64_t us);
+sim_event_id sim_schedule_at(uint64_t at_us, sim_event_fn fn, void *arg);
+sim_event_id sim_schedule_in(uint64_t delay_us, sim_event_fn fn, void *arg);
+void sim_cancel(sim_event_id id);
+void sim_advance_us(uint64_t us);
+void sim_idle(void);
+void sim_trace(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+extern bool sim_trace_enabled;
+
+/////////////////////////////////////////////////////
+//             POWER AND SHARED STATE              //
+/////////////////////////////////////////////////////
+
+enum sim_reset_reason {
+    SIM_RESET_POWER_ON,
+    SIM_RESET_WATCHDOG,
+};
+
+void *sim_shared_alloc(size_t size);
+void sim_world_reset(void);
+int sim_world_run(void (*boot)(void));
+void sim_world_report(FILE *out);
+void sim_metric_register(const char *name, const uint64_t *value);
+bool sim_metric_get(const char *name, uint64_t *value);
+enum sim_reset_reason sim_reset_reason(void);
+void sim_reboot(enum sim_reset_reason reason) __attribute__((noreturn));
+void sim_power_cycle(uint64_t off_us) __attribute__((noreturn));
+void sim_exit(int status) __attribute__((noreturn));
+
+/////////////////////////////////////////////////////
+//                  INTERRUPTS                     //
+/////////////////////////////////////////////////////
+
+void sim_irq_raise(uint num);
+
+/////////////////////////////////////////////////////
+//                     GPIO                        //
+/////////////////////////////////////////////////////
+
+void sim_gpio_init(void);
+void sim_gpio_drive(uint gpio, bool level);
+void sim_gpio_release(uint gpio);
+bool sim_gpio_output(uint gpio);
+void sim_button_press(uint gpio, uint32_t hold_ms);
+void sim_button_reaction(void);
+void sim_gpio_report(FILE *out);
+
+/////////////////////////////////////////////////////
+//                  STEPPER WHEEL                  //
+/////////////////////////////////////////////////////
+
+void sim_motor_init(int steps_per_revolution, int start_position);
+void sim_motor_boot(void);
+bool sim_motor_load(uint8_t mask);
+void sim_motor_slip(int steps);
+bool sim_motor_turning(void);
+void sim_motor_coils_changed(void);
+void sim_motor_report(FILE *out);
+
+/////////////////////////////////////////////////////
+//                    EEPROM                       //
+/////////////////////////////////////////////////////
+
+#define SIM_I2C_SDA 16
+#define SIM_I2C_SCL 17
+
+void sim_eeprom_init(const char *image_path);
+void sim_eeprom_power_loss(void);
+void sim_eeprom_hold_bus(void);
+void sim_eeprom_scl_changed(bool level);
+void sim_eeprom_save(void);
+void sim_eeprom_report(FILE *out);
+
+/////////////////////////////////////////////////////
+//                 UART AND MODEM                  //
+/////////////////////////////////////////////////////
+
+void sim_uart_init(void);
+void sim_uart_rx_push(uint index, uint8_t byte);
+void sim_uart_sync(void);
+void sim_uart_report(FILE *out);
+void sim_modem_init(void);
+void sim_modem_receive(uint8_t byte);
+bool sim_modem_uplink_seen(const char *text);
+void sim_modem_report(FILE *out);
+
+/////////////////////////////////////////////////////
+//                    WATCHDOG                     //
+/////////////////////////////////////////////////////
+
+void sim_watchdog_init(void);
+void sim_watchdog_report(FILE *out);
+
+/////////////////////////////////////////////////////
+//                    ENERGY                       //
+/////////////////////////////////////////////////////
+
+enum sim_energy_source {
+    SIM_ENERGY_MCU,
+    SIM_ENERGY_COILS,
+    SIM_ENERGY_LEDS,
+    SIM_ENERGY_MODEM,
+    SIM_ENERGY_EEPROM,
+    SIM_ENERGY_SOURCES
+};
+
+void sim_energy_init(void);
+void sim_energy_set(enum sim_energy_source source, uint64_t ua);
+void sim_energy_pulse(enum sim_energy_source source, uint64_t ua, uint64_t us);
+void sim_energy_cpu_sleep(bool sleeping);
+void sim_energy_event(void);
+void sim_energy_coils(int energized);
+void sim_energy_leds(uint64_t duty_sum, uint64_t full_duty);
+void sim_energy_transmit(uint64_t airtime_us);
+void sim_energy_eeprom_write(uint64_t cycle_us);
+void sim_energy_reset(bool power_lost);
+void sim_energy_boot(void);
+void sim_energy_turn(uint64_t start_us, uint64_t start_uaus);
+uint64_t sim_energy_charge_uaus(void);
+void sim_energy_report(FILE *out);
+
+/////////////////////////////////////////////////////
+//                   SCENARIOS                     //
+/////////////////////////////////////////////////////
+
+bool sim_scenario_load(const char *path, const char *var, const char *value);
+void sim_scenario_boot(void);
+void sim_scenario_step(uint64_t steps);
+uint64_t sim_scenario_failures(void);
+
+#endif
@@ -0,0 +1,165 @@
+/*
+ * Energy accounting. Every model tells this one how much current its part draws from the supply whenever that
+ * changes, or adds the charge of a burst of known length, and the charge is integrated over simulated time. The
+ * currents are estimates from the data sheets for a Pico W with its radio off, a 28BYJ-48 on a ULN2003 at 5 V, the
+ * LoRa-E5 at 14 dBm and the 24LC256; they are meant for comparing firmware configurations, not for a battery budget.
+ *
+ * A dispense cycle runs from the start of one compartment turn to the start of the next. Its charge is what the
+ * device drew in between, averaged over the cycles of the run.
+ */
+#include "sim.h"
+
+#include "motor.h"
+#include "scheduler.h"
+
+#define MCU_ACTIVE_UA 21000         // RP2040 at 125 MHz running code, including the regulator
+#define MCU_SLEEP_UA 8000           // RP2040 in WFI or WFE with all clocks running
+#define COIL_UA 100000              // one energized coil of the 28BYJ-48 at 5 V
+#define LED_UA 10000                // one LED at full duty
+#define MODEM_IDLE_UA 3000          // LoRa-E5 awake between commands
+#define MODEM_TX_UA 44000           // on top of idle while transmitting
+#define EEPROM_WRITE_UA 3000        // 24LC256 during a write cycle
+#define WAKEUP_US 10                // the core runs an interrupt handler and goes back to sleep
+
+#define CYCLE_MAX_US (2ull * SLEEP_BETWEEN * 1000u)   // turns further apart are not one cycle
+
+/* What a dispense cycle may cost in this build, for scenarios to check against: a low power build stays below the
+ * base, an awake core and held coils each add what they cost in dispense_week.scn with some margin. */
+#define CYCLE_BUDGET_UAH (200u + (SCHEDULER_IDLE_SLEEP ? 0u : 200u) + (STEPPER_HOLD ? 1800u : 0u))
+
+static const char *const source_names[SIM_ENERGY_SOURCES] = {"mcu", "coils", "leds", "modem", "eeprom"};
+
+typedef struct sim_energy {
+    uint64_t level_ua[SIM_ENERGY_SOURCES];
+    uint64_t charge_uaus[SIM_ENERGY_SOURCES];
+    uint64_t last_us;
+    uint64_t charge_uah;            // metric: total so far
+    uint64_t cycle_uah;             // metric: average charge of a dispense cycle
+    uint64_t cycle_budget_uah;      // metric: CYCLE_BUDGET_UAH
+    uint64_t wakeups;               // metric: interrupts that woke the core from a sleep
+    uint64_t last_wakeup_us;
+    bool sleeping;
+    uint64_t cycles;
+    uint64_t cycles_uaus;
+    bool turned;
+    uint64_t turn_us;               // start of the last turn
+    uint64_t turn_uaus;             // total charge at that time
+} sim_energy;
+
+static sim_energy *energy;
+
+static uint64_t total_uaus(void) {
+    uint64_t total = 0;
+    for (int i = 0; i < SIM_ENERGY_SOURCES; i++) {
+        total += energy->charge_uaus[i];
+    }
+    return total;
+}
+
+static void integrate(void) {
+    uint64_t now = sim_time_us();
+    for (int i = 0; i < SIM_ENERGY_SOURCES; i++) {
+        energy->charge_uaus[i] += energy->level_ua[i] * (now - energy->last_us);
+    }
+    energy->last_us = now;
+    energy->charge_uah = total_uaus() / 3600000000u;
+}
+
+void sim_energy_init(void) {
+    energy = sim_shared_alloc(sizeof(*energy));
+    energy->last_us = sim_time_us();
+    sim_metric_register("charge_uah", &energy->charge_uah);
+    energy->cycle_budget_uah = CYCLE_BUDGET_UAH;
+    sim_metric_register("cycle_charge_uah", &energy->cycle_uah);
+    sim_metric_register("cycle_charge_budget_uah", &energy->cycle_budget_uah);
+    sim_metric_register("wakeups", &energy->wakeups);
+}
+
+void sim_energy_set(enum sim_energy_source source, uint64_t ua) {
+    integrate();
+    energy->level_ua[source] = ua;
+}
+
+void sim_energy_pulse(enum sim_energy_source source, uint64_t ua, uint64_t us) {
+    integrate();
+    energy->charge_uaus[source] += ua * us;
+    energy->charge_uah = total_uaus() / 3600000000u;
+}
+
+/* The core waits for an interrupt in WFI or WFE while time passes in a sleep, or runs code while it spins or polls a bus. */
+void sim_energy_cpu_sleep(bool sleeping) {
+    energy->sleeping = sleeping;
+    sim_energy_set(SIM_ENERGY_MCU, sleeping ? MCU_SLEEP_UA : MCU_ACTIVE_UA);
+}
+
+/* Every simulator event stands for an interrupt. Those at the same time share one wakeup. */
+void sim_energy_event(void) {
+    uint64_t now = sim_time_us();
+    if (energy->sleeping && now != energy->last_wakeup_us) {
+        energy->wakeups++;
+        energy->last_wakeup_us = now;
+        sim_energy_pulse(SIM_ENERGY_MCU, MCU_ACTIVE_UA - MCU_SLEEP_UA, WAKEUP_US);
+    }
+}
+
+void sim_energy_coils(int energized) {
+    sim_energy_set(SIM_ENERGY_COILS, (uint64_t) energized * COIL_UA);
+}
+
+void sim_energy_leds(uint64_t duty_sum, uint64_t full_duty) {
+    sim_energy_set(SIM_ENERGY_LEDS, duty_sum * LED_UA / full_duty);
+}
+
+void sim_energy_transmit(uint64_t airtime_us) {
+    sim_energy_pulse(SIM_ENERGY_MODEM, MODEM_TX_UA, airtime_us);
+}
+
+void sim_energy_eeprom_write(uint64_t cycle_us) {
+    sim_energy_pulse(SIM_ENERGY_EEPROM, EEPROM_WRITE_UA, cycle_us);
+}
+
+/* A reset turns the GPIO off and starts the core from the boot ROM; the modem keeps its supply unless the power went. */
+void sim_energy_reset(bool power_lost) {
+    integrate();
+    for (int i = 0; i < SIM_ENERGY_SOURCES; i++) {
+        if (SIM_ENERGY_MODEM != i || power_lost) {
+            energy->level_ua[i] = 0;
+        }
+    }
+}
+
+void sim_energy_boot(void) {
+    energy->sleeping = false;
+    sim_energy_set(SIM_ENERGY_MCU, MCU_ACTIVE_UA);
+    sim_energy_set(SIM_ENERGY_MODEM, MODEM_IDLE_UA);
+}
+
+/* Called for a turn of the wheel by about one compartment, with the time and total charge at its start. */
+void sim_energy_turn(uint64_t start_us, uint64_t start_uaus) {
+    if (energy->turned && start_us - energy->turn_us <= CYCLE_MAX_US) {
+        energy->cycles++;
+        energy->cycles_uaus += start_uaus - energy->turn_uaus;
+        energy->cycle_uah = energy->cycles_uaus / energy->cycles / 3600000000u;
+    }
+    energy->turned = true;
+    energy->turn_us = start_us;
+    energy->turn_uaus = start_uaus;
+}
+
+uint64_t sim_energy_charge_uaus(void) {
+    integrate();
+    return total_uaus();
+}
+
+void sim_energy_report(FILE *out) {
+    integrate();
+    fprintf(out, "energy: %.3f mAh (", (double) total_uaus() / 3.6e12);
+    for (int i = 0; i < SIM_ENERGY_SOURCES; i++) {
+        fprintf(out, "%s%s %.3f", 0 == i ? "" : ", ", source_names[i], (double) energy->charge_uaus[i] / 3.6e12);
+    }
+    fprintf(out, "), %.4f mAh per dispense cycle over %llu cycles, %.2f mA average, %llu wakeups\n",
+            0 == energy->cycles ? 0.0 : (double) energy->cycles_uaus / (double) energy->cycles / 3.6e12,
+            (unsigned long long) energy->cycles,
+            0 == energy->last_us ? 0.0 : (double) total_uaus() / (double) energy->last_us / 1000.0,
+            (unsigned long long) energy->wakeups);
+}
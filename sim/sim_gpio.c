@@ -0,0 +1,287 @@
+/*
+ * Simulated bank 0 GPIO and PWM. Inputs read the level driven by a model (button, optofork, piezo) or fall back to
+ * the configured pull. Falling and rising edges on inputs call the firmware's GPIO callback immediately, the same way
+ * IO_IRQ_BANK0 would preempt the running code. Coil outputs are forwarded to the stepper model.
+ */
+#include "hardware/gpio.h"
+#include "hardware/pwm.h"
+#include "sim.h"
+
+#include "button.h"
+#include "led.h"
+#include "motor.h"
+
+typedef struct sim_pin {
+    enum gpio_function function;
+    bool out;
+    bool level;
+    bool driven;
+    bool drive_level;
+    bool pull_up;
+    bool pull_down;
+    uint32_t irq_mask;
+    uint16_t pwm_level;
+} sim_pin;
+
+typedef struct sim_gpio_stats {
+    uint64_t puts;
+    uint64_t irqs;
+    uint64_t led_changes;
+    uint64_t button_presses;
+    uint64_t button_latency_us;     // from the last press that moved the wheel to the first step after it
+} sim_gpio_stats;
+
+static sim_pin pins[NUM_BANK0_GPIOS];
+static uint16_t slice_levels[8][2];
+static gpio_irq_callback_t irq_callback;
+static sim_gpio_stats *stats;
+static bool leds_lit;
+static bool press_pending;
+static uint64_t press_us;
+
+static bool pin_input_level(const sim_pin *p) {
+    if (p->driven) {
+        return p->drive_level;
+    }
+    return p->pull_up && !p->pull_down;
+}
+
+static bool pin_level(const sim_pin *p) {
+    return p->out ? p->level : pin_input_level(p);
+}
+
+static void input_changed(uint gpio, bool before) {
+    bool after = pin_level(&pins[gpio]);
+    if (before == after) {
+        return;
+    }
+    uint32_t event = after ? GPIO_IRQ_EDGE_RISE : GPIO_IRQ_EDGE_FALL;
+    if ((pins[gpio].irq_mask & event) && NULL != irq_callback) {
+        stats->irqs++;
+        irq_callback(gpio, event);
+    }
+}
+
+/* SCL taken over as a GPIO clocks the EEPROM, whether it is driven low or let go to its pull-up. */
+static void scl_changed(bool before) {
+    bool after = pin_level(&pins[SIM_I2C_SCL]);
+    if (GPIO_FUNC_SIO == pins[SIM_I2C_SCL].function && before != after) {
+        sim_eeprom_scl_changed(after);
+    }
+}
+
+/////////////////////////////////////////////////////
+//                  MODEL SIDE                     //
+/////////////////////////////////////////////////////
+
+void sim_gpio_drive(uint gpio, bool level) {
+    bool before = pin_level(&pins[gpio]);
+    pins[gpio].driven = true;
+    pins[gpio].drive_level = level;
+    input_changed(gpio, before);
+}
+
+void sim_gpio_release(uint gpio) {
+    bool before = pin_level(&pins[gpio]);
+    pins[gpio].driven = false;
+    input_changed(gpio, before);
+}
+
+bool sim_gpio_output(uint gpio) {
+    return pins[gpio].out && pins[gpio].level;
+}
+
+/* Contacts bounce: after a press or release the pin flips back and forth for about 2 ms before it settles. */
+static const uint32_t bounce_us[] = {200, 500, 1100, 1900};
+
+static void button_bounce(void *arg) {
+    uint gpio = (uint) ((uintptr_t) arg & 0xff);
+    bool down = 0 != ((uintptr_t) arg & 0x100);
+    if (down) {
+        sim_gpio_drive(gpio, false);
+    } else {
+        sim_gpio_release(gpio);
+    }
+}
+
+static void button_edge(uint gpio, bool down) {
+    button_bounce((void *) (uintptr_t) (gpio | (down ? 0x100u : 0u)));
+    for (size_t i = 0; i < sizeof(bounce_us) / sizeof(bounce_us[0]); i++) {
+        bool level = down == (1 == i % 2);
+        sim_schedule_in(bounce_us[i], button_bounce, (void *) (uintptr_t) (gpio | (level ? 0x100u : 0u)));
+    }
+}
+
+static void button_release(void *arg) {
+    button_edge((uint) (uintptr_t) arg, false);
+}
+
+void sim_button_press(uint gpio, uint32_t hold_ms) {
+    sim_trace("button %s pressed", SW_0 == gpio ? "SW_0" : SW_2 == gpio ? "SW_2" : "?");
+    stats->button_presses++;
+    press_pending = true;
+    press_us = sim_time_us();
+    button_edge(gpio, true);
+    sim_schedule_in((uint64_t) hold_ms * 1000u, button_release, (void *) (uintptr_t) gpio);
+}
+
+void sim_button_reaction(void) {
+    if (press_pending) {
+        press_pending = false;
+        stats->button_latency_us = sim_time_us() - press_us;
+    }
+}
+
+void sim_gpio_init(void) {
+    stats = sim_shared_alloc(sizeof(*stats));
+    sim_metric_register("gpio_puts", &stats->puts);
+    sim_metric_register("gpio_irqs", &stats->irqs);
+    sim_metric_register("button_presses", &stats->button_presses);
+    sim_metric_register("led_changes", &stats->led_changes);
+    sim_metric_register("button_latency_us", &stats->button_latency_us);
+}
+
+void sim_gpio_report(FILE *out) {
+    fprintf(out, "gpio: %llu pin writes, %llu edge interrupts, %llu button presses (%llu us to the first step), "
+            "%llu led changes\n", (unsigned long long) stats->puts, (unsigned long long) stats->irqs,
+            (unsigned long long) stats->button_presses, (unsigned long long) stats->button_latency_us,
+            (unsigned long long) stats->led_changes);
+}
+
+/////////////////////////////////////////////////////
+//                 HARDWARE_GPIO                   //
+/////////////////////////////////////////////////////
+
+void gpio_init(uint gpio) {
+    pins[gpio].function = GPIO_FUNC_SIO;
+    pins[gpio].out = false;
+    pins[gpio].level = false;
+}
+
+void gpio_set_function(uint gpio, enum gpio_function fn) {
+    pins[gpio].function = fn;
+}
+
+void gpio_set_dir(uint gpio, bool out) {
+    bool before = pin_level(&pins[gpio]);
+    pins[gpio].out = out;
+    if (SIM_I2C_SCL == gpio) {
+        scl_changed(before);
+    }
+}
+
+void gpio_pull_up(uint gpio) {
+    pins[gpio].pull_up = true;
+    pins[gpio].pull_down = false;
+}
+
+void gpio_pull_down(uint gpio) {
+    pins[gpio].pull_up = false;
+    pins[gpio].pull_down = true;
+}
+
+void gpio_disable_pulls(uint gpio) {
+    pins[gpio].pull_up = false;
+    pins[gpio].pull_down = false;
+}
+
+bool gpio_get(uint gpio) {
+    return pin_level(&pins[gpio]);
+}
+
+uint32_t gpio_get_all(void) {
+    uint32_t all = 0;
+    for (uint i = 0; i < NUM_BANK0_GPIOS; i++) {
+        all |= (uint32_t) pin_level(&pins[i]) << i;
+    }
+    return all;
+}
+
+void gpio_put(uint gpio, bool value) {
+    stats->puts++;
+    if (pins[gpio].level == value) {
+        return;
+    }
+    bool before = pin_level(&pins[gpio]);
+    pins[gpio].level = value;
+    if (IN1 == gpio || IN2 == gpio || IN3 == gpio || IN4 == gpio) {
+        sim_motor_coils_changed();
+    } else if (SIM_I2C_SCL == gpio) {
+        scl_changed(before);
+    }
+}
+
+/* All pins change at once, so the stepper model sees the new coil pattern without the steps in between. */
+void gpio_put_masked(uint32_t mask, uint32_t value) {
+    bool coils = false;
+    stats->puts++;
+    for (uint gpio = 0; gpio < NUM_BANK0_GPIOS; gpio++) {
+        bool level = 0 != (value & (1u << gpio));
+        if (0 != (mask & (1u << gpio)) && pins[gpio].level != level) {
+            pins[gpio].level = level;
+            coils = coils || IN1 == gpio || IN2 == gpio || IN3 == gpio || IN4 == gpio;
+        }
+    }
+    if (coils) {
+        sim_motor_coils_changed();
+    }
+}
+
+void gpio_set_irq_enabled(uint gpio, uint32_t event_mask, bool enabled) {
+    if (enabled) {
+        pins[gpio].irq_mask |= event_mask;
+    } else {
+        pins[gpio].irq_mask &= ~event_mask;
+    }
+}
+
+void gpio_set_irq_enabled_with_callback(uint gpio, uint32_t event_mask, bool enabled, gpio_irq_callback_t callback) {
+    gpio_set_irq_enabled(gpio, event_mask, enabled);
+    irq_callback = callback;
+}
+
+/////////////////////////////////////////////////////
+//                  HARDWARE_PWM                   //
+/////////////////////////////////////////////////////
+
+pwm_config pwm_get_default_config(void) {
+    pwm_config c = {.csr = 0, .div = 1u << 4, .top = 0xffff};
+    return c;
+}
+
+void pwm_config_set_clkdiv_int(pwm_config *c, uint div) {
+    c->div = div << 4;
+}
+
+void pwm_config_set_wrap(pwm_config *c, uint16_t wrap) {
+    c->top = wrap;
+}
+
+uint pwm_gpio_to_slice_num(uint gpio) {
+    return (gpio >> 1u) & 7u;
+}
+
+uint pwm_gpio_to_channel(uint gpio) {
+    return gpio & 1u;
+}
+
+void pwm_init(uint slice_num, pwm_config *c, bool start) {
+}
+
+void pwm_set_enabled(uint slice_num, bool enabled) {
+}
+
+void pwm_set_chan_level(uint slice_num, uint chan, uint16_t level) {
+    slice_levels[slice_num][chan] = level;
+}
+
+void pwm_set_gpio_level(uint gpio, uint16_t level) {
+    pins[gpio].pwm_level = level;
+    sim_energy_leds((uint64_t) pins[D1].pwm_level + pins[D2].pwm_level + pins[D3].pwm_level, PWM_FREQ);
+    bool lit = pins[D1].pwm_level > MIN_BRIGHTNESS || pins[D2].pwm_level > MIN_BRIGHTNESS ||
+               pins[D3].pwm_level > MIN_BRIGHTNESS;
+    if (lit != leds_lit) {
+        leds_lit = lit;
+        stats->led_changes++;
+    }
+}
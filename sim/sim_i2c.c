@@ -0,0 +1,246 @@
+/*
+ * Simulated i2c0 bus with a 24LC256 EEPROM (32 KiB, 64 byte pages) at address 0x50.
+ *
+ * A write transfer carries a two byte address followed by data that wraps inside the addressed page, and starts an
+ * internal write cycle during which the device does not acknowledge its address. A read continues from the current
+ * address pointer and wraps at the end of the array. Every transfer charges its bus time at the configured baud rate
+ * to the simulated clock, and the share of it spent while the wheel turns is kept apart. The array can be loaded from and saved to an image file so state survives between runs.
+ *
+ * Losing power during a write cycle tears the page: only the share of the new bytes proportional to the elapsed part
+ * of the cycle has been programmed, the rest keep their old contents.
+ *
+ * The 24LC256 runs at up to 400 kHz and does not acknowledge anything clocked faster. A device can also be made to
+ * hold SDA low, as it does when the master resets in the middle of a read: every transfer then hangs, or times out
+ * with the _timeout_us variants, until the master clocks SCL by hand a few times.
+ */
+#include <string.h>
+
+#include "hardware/i2c.h"
+#include "sim.h"
+
+#define EEPROM_ADDR 0x50
+#define EEPROM_SIZE 32768
+#define EEPROM_PAGE 64
+#define EEPROM_WRITE_CYCLE_US 5000
+#define I2C_BITS_PER_BYTE 9
+#define EEPROM_MAX_BAUDRATE 400000
+#define STUCK_BITS 5                // SCL clocks it takes to let go of SDA
+
+struct i2c_inst {
+    uint baudrate;
+};
+
+typedef struct sim_eeprom_stats {
+    uint64_t transfers;
+    uint64_t bytes_written;
+    uint64_t bytes_read;
+    uint64_t write_cycles;
+    uint64_t nacks;
+    uint64_t torn_writes;
+    uint64_t bus_us;
+    uint64_t bus_turning_us;
+    uint64_t timeouts;
+    uint64_t bus_recoveries;
+} sim_eeprom_stats;
+
+typedef struct sim_eeprom {
+    uint8_t memory[EEPROM_SIZE];
+    uint8_t old_page[EEPROM_PAGE];
+    uint16_t page_address;
+    uint16_t write_start;
+    uint16_t write_length;
+    uint64_t busy_until_us;
+    int stuck_bits;                 // SCL clocks until SDA is released, 0 if the bus is free
+    sim_eeprom_stats stats;
+} sim_eeprom;
+
+i2c_inst_t sim_i2c0_inst;
+i2c_inst_t sim_i2c1_inst;
+
+static sim_eeprom *eeprom;
+static uint16_t address_pointer;
+static const char *image;
+
+/* Start, address byte and stop, plus one ACKed byte per transferred byte. */
+static void charge_bus_time(i2c_inst_t *i2c, size_t bytes) {
+    uint baudrate = i2c->baudrate ? i2c->baudrate : 100000;
+    uint64_t us = ((uint64_t) (bytes + 1) * I2C_BITS_PER_BYTE + 2) * 1000000u / baudrate;
+    eeprom->stats.transfers++;
+    eeprom->stats.bus_us += us;
+    if (sim_motor_turning()) {
+        eeprom->stats.bus_turning_us += us;
+    }
+    sim_advance_us(us);
+}
+
+static bool device_acks(i2c_inst_t *i2c, uint8_t addr) {
+    if (EEPROM_ADDR != addr || sim_time_us() < eeprom->busy_until_us || i2c->baudrate > EEPROM_MAX_BAUDRATE) {
+        eeprom->stats.nacks++;
+        return false;
+    }
+    return true;
+}
+
+void sim_eeprom_init(const char *image_path) {
+    eeprom = sim_shared_alloc(sizeof(*eeprom));
+    memset(eeprom->memory, 0xff, sizeof(eeprom->memory));
+    image = image_path;
+    if (NULL != image) {
+        FILE *f = fopen(image, "rb");
+        if (NULL != f) {
+            size_t n = fread(eeprom->memory, 1, sizeof(eeprom->memory), f);
+            fclose(f);
+            sim_trace("eeprom image %s loaded (%zu bytes)", image, n);
+        }
+    }
+    sim_metric_register("eeprom_transfers", &eeprom->stats.transfers);
+    sim_metric_register("eeprom_bytes_written", &eeprom->stats.bytes_written);
+    sim_metric_register("eeprom_write_cycles", &eeprom->stats.write_cycles);
+    sim_metric_register("eeprom_bytes_read", &eeprom->stats.bytes_read);
+    sim_metric_register("eeprom_nacks", &eeprom->stats.nacks);
+    sim_metric_register("eeprom_bus_us", &eeprom->stats.bus_us);
+    sim_metric_register("eeprom_bus_turning_us", &eeprom->stats.bus_turning_us);
+    sim_metric_register("eeprom_torn_writes", &eeprom->stats.torn_writes);
+    sim_metric_register("eeprom_timeouts", &eeprom->stats.timeouts);
+    sim_metric_register("eeprom_bus_recoveries", &eeprom->stats.bus_recoveries);
+}
+
+void sim_eeprom_power_loss(void) {
+    uint64_t now = sim_time_us();
+    eeprom->stuck_bits = 0;
+    if (now >= eeprom->busy_until_us) {
+        return;
+    }
+    uint64_t elapsed = now + EEPROM_WRITE_CYCLE_US - eeprom->busy_until_us;
+    uint16_t programmed = (uint16_t) (eeprom->write_length * elapsed / EEPROM_WRITE_CYCLE_US);
+    for (uint16_t i = programmed; i < eeprom->write_length; i++) {
+        uint16_t offset = (eeprom->write_start + i) & (EEPROM_PAGE - 1);
+        eeprom->memory[eeprom->page_address | offset] = eeprom->old_page[offset];
+    }
+    eeprom->busy_until_us = 0;
+    eeprom->stats.torn_writes++;
+    sim_trace("eeprom write at 0x%04x torn after %u of %u bytes", eeprom->page_address | eeprom->write_start,
+              programmed, eeprom->write_length);
+}
+
+void sim_eeprom_hold_bus(void) {
+    sim_trace("eeprom holds SDA low");
+    eeprom->stuck_bits = STUCK_BITS;
+    sim_gpio_drive(SIM_I2C_SDA, false);
+}
+
+void sim_eeprom_scl_changed(bool level) {
+    if (level && eeprom->stuck_bits > 0 && 0 == --eeprom->stuck_bits) {
+        sim_trace("eeprom released SDA");
+        eeprom->stats.bus_recoveries++;
+        sim_gpio_release(SIM_I2C_SDA);
+    }
+}
+
+void sim_eeprom_save(void) {
+    if (NULL == image) {
+        return;
+    }
+    FILE *f = fopen(image, "wb");
+    if (NULL != f) {
+        fwrite(eeprom->memory, 1, sizeof(eeprom->memory), f);
+        fclose(f);
+    }
+}
+
+void sim_eeprom_report(FILE *out) {
+    const sim_eeprom_stats *s = &eeprom->stats;
+    fprintf(out, "eeprom: %llu transfers, %llu bytes written in %llu write cycles, %llu bytes read, %llu nacks, "
+                 "%llu torn writes, %llu timeouts, %llu bus recoveries, %llu.%03llu ms bus time, %llu.%03llu ms of it "
+                 "while the wheel turned\n",
+            (unsigned long long) s->transfers, (unsigned long long) s->bytes_written,
+            (unsigned long long) s->write_cycles, (unsigned long long) s->bytes_read, (unsigned long long) s->nacks,
+            (unsigned long long) s->torn_writes, (unsigned long long) s->timeouts,
+            (unsigned long long) s->bus_recoveries, (unsigned long long) (s->bus_us / 1000u),
+            (unsigned long long) (s->bus_us % 1000u), (unsigned long long) (s->bus_turning_us / 1000u),
+            (unsigned long long) (s->bus_turning_us % 1000u));
+}
+
+/////////////////////////////////////////////////////
+//                 HARDWARE_I2C                    //
+/////////////////////////////////////////////////////
+
+uint i2c_init(i2c_inst_t *i2c, uint baudrate) {
+    return i2c_set_baudrate(i2c, baudrate);
+}
+
+void i2c_deinit(i2c_inst_t *i2c) {
+    i2c->baudrate = 0;
+}
+
+uint i2c_set_baudrate(i2c_inst_t *i2c, uint baudrate) {
+    i2c->baudrate = baudrate;
+    return baudrate;
+}
+
+/* A held bus never completes a transfer; the watchdog or the end of the run gets the firmware out of here. */
+static void wait_for_bus(void) {
+    while (eeprom->stuck_bits > 0) {
+        sim_advance_us(1000);
+    }
+}
+
+static bool bus_times_out(uint timeout_us) {
+    if (0 == eeprom->stuck_bits) {
+        return false;
+    }
+    eeprom->stats.timeouts++;
+    sim_advance_us(timeout_us);
+    return true;
+}
+
+int i2c_write_blocking(i2c_inst_t *i2c, uint8_t addr, const uint8_t *src, size_t len, bool nostop) {
+    wait_for_bus();
+    if (!device_acks(i2c, addr)) {
+        charge_bus_time(i2c, 0);
+        return PICO_ERROR_GENERIC;
+    }
+    charge_bus_time(i2c, len);
+    if (len >= 2) {
+        address_pointer = (uint16_t) (((src[0] << 8) | src[1]) & (EEPROM_SIZE - 1));
+    }
+    if (len > 2) {
+        uint16_t page = address_pointer & ~(EEPROM_PAGE - 1);
+        memcpy(eeprom->old_page, &eeprom->memory[page], EEPROM_PAGE);
+        eeprom->page_address = page;
+        eeprom->write_start = address_pointer & (EEPROM_PAGE - 1);
+        eeprom->write_length = (uint16_t) (len - 2 < EEPROM_PAGE ? len - 2 : EEPROM_PAGE);
+        for (size_t i = 2; i < len; i++) {
+            eeprom->memory[address_pointer] = src[i];
+            address_pointer = page | ((address_pointer + 1) & (EEPROM_PAGE - 1));
+        }
+        eeprom->stats.bytes_written += len - 2;
+        eeprom->stats.write_cycles++;
+        eeprom->busy_until_us = sim_time_us() + EEPROM_WRITE_CYCLE_US;
+        sim_energy_eeprom_write(EEPROM_WRITE_CYCLE_US);
+    }
+    return (int) len;
+}
+
+int i2c_read_blocking(i2c_inst_t *i2c, uint8_t addr, uint8_t *dst, size_t len, bool nostop) {
+    wait_for_bus();
+    if (!device_acks(i2c, addr)) {
+        charge_bus_time(i2c, 0);
+        return PICO_ERROR_GENERIC;
+    }
+    charge_bus_time(i2c, len);
+    for (size_t i = 0; i < len; i++) {
+        dst[i] = eeprom->memory[address_pointer];
+        address_pointer = (address_pointer + 1) & (EEPROM_SIZE - 1);
+    }
+    eeprom->stats.bytes_read += len;
+    return (int) len;
+}
+
+int i2c_write_timeout_us(i2c_inst_t *i2c, uint8_t addr, const uint8_t *src, size_t len, bool nostop, uint timeout_us) {
+    return bus_times_out(timeout_us) ? PICO_ERROR_TIMEOUT : i2c_write_blocking(i2c, addr, src, len, nostop);
+}
+
+int i2c_read_timeout_us(i2c_inst_t *i2c, uint8_t addr, uint8_t *dst, size_t len, bool nostop, uint timeout_us) {
+    return bus_times_out(timeout_us) ? PICO_ERROR_TIMEOUT : i2c_read_blocking(i2c, addr, dst, len, nostop);
+}
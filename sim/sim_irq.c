@@ -0,0 +1,39 @@
+/*
+ * Simulated NVIC: per-line enable, exclusive handlers and pending state. A raised line runs its handler straight away
+ * unless it is disabled or already active, in which case it stays pending until irq_set_enabled() re-enables it.
+ */
+#include "hardware/irq.h"
+#include "sim.h"
+
+static irq_handler_t handlers[NUM_IRQS];
+static bool enabled[NUM_IRQS];
+static bool pending[NUM_IRQS];
+static bool active[NUM_IRQS];
+
+static void irq_run(uint num) {
+    while (pending[num] && enabled[num] && !active[num] && NULL != handlers[num]) {
+        pending[num] = false;
+        active[num] = true;
+        handlers[num]();
+        active[num] = false;
+        sim_uart_sync();
+    }
+}
+
+void sim_irq_raise(uint num) {
+    pending[num] = true;
+    irq_run(num);
+}
+
+void irq_set_enabled(uint num, bool on) {
+    enabled[num] = on;
+    irq_run(num);
+}
+
+bool irq_is_enabled(uint num) {
+    return enabled[num];
+}
+
+void irq_set_exclusive_handler(uint num, irq_handler_t handler) {
+    handlers[num] = handler;
+}
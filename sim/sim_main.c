@@ -0,0 +1,219 @@
+/*
+ * Entry point of the host simulator. Sets up the device models and boots the firmware's main(), again after every
+ * simulated reset.
+ *
+ * Usage: Pill_dispenser_sim [--eeprom FILE] [--pills MASK] [--steps N] [--start-step N] [--quiet]
+ *                           [--scenario FILE [--sweep VAR=FROM:TO[:STEP]]] [--realtime] [--time-limit SECONDS]
+ *
+ * Without a scenario the simulator runs in realtime and lines on stdin act as the user: "0" presses SW_0, "2" presses
+ * SW_2, "p" cycles the power, "s" prints statistics and "q" quits. Pressing SW_2 first fills an empty wheel with the
+ * compartments selected by MASK (bit 1..7, default 0xfe), as the user would before starting to dispense.
+ *
+ * With a scenario (see sim_scenario.c) simulated time runs freely, so days of operation take well under a second,
+ * until the script ends or the time limit is reached. A sweep runs the scenario once for every value of $VAR from FROM
+ * to TO, each time on a factory-fresh device, and prints one line per run. The exit status is 1 if any expectation
+ * failed. With --eeprom the EEPROM contents are loaded from FILE at start and, outside sweeps, written back at the end.
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "sim.h"
+
+#include "button.h"
+
+#define BUTTON_HOLD_MS 200
+#define POWER_OFF_US 1000000u
+#define DEFAULT_TIME_LIMIT_S 86400u
+
+int firmware_main(void);
+
+typedef struct sim_options {
+    const char *image;
+    const char *scenario;
+    const char *sweep_var;
+    long sweep_from;
+    long sweep_to;
+    long sweep_step;
+    int steps;
+    int start_step;
+    bool realtime;
+    uint64_t time_limit_us;
+} sim_options;
+
+static uint8_t pill_mask = 0xfe;
+static sim_options options = {.steps = 4096, .start_step = 1000, .sweep_step = 1};
+static bool sweeping;
+
+static void report(FILE *out) {
+    fprintf(out, "--- simulated %llu.%03llu s ---\n", (unsigned long long) (sim_time_us() / 1000000u),
+            (unsigned long long) (sim_time_us() / 1000u % 1000u));
+    sim_world_report(out);
+    sim_motor_report(out);
+    sim_eeprom_report(out);
+    sim_uart_report(out);
+    sim_modem_report(out);
+    sim_gpio_report(out);
+    sim_watchdog_report(out);
+    sim_energy_report(out);
+}
+
+void sim_command(const char *line) {
+    if (0 == strcmp(line, "0")) {
+        sim_button_press(SW_0, BUTTON_HOLD_MS);
+    } else if (0 == strcmp(line, "2")) {
+        sim_motor_load(pill_mask);
+        sim_button_press(SW_2, BUTTON_HOLD_MS);
+    } else if (0 == strcmp(line, "p")) {
+        sim_power_cycle(POWER_OFF_US);
+    } else if (0 == strcmp(line, "s")) {
+        report(stderr);
+    } else if (0 == strcmp(line, "q")) {
+        sim_exit(0);
+    } else if ('\0' != line[0]) {
+        fprintf(stderr, "sim: unknown command '%s' (0, 2, p, s, q)\n", line);
+    }
+}
+
+static void time_limit_reached(void *arg) {
+    sim_trace("time limit reached");
+    sim_exit(0);
+}
+
+/* Runs in a fresh child process for every boot of the device. */
+static void boot(void) {
+    uint64_t boots = 0;
+    sim_metric_get("boots", &boots);
+    if (sweeping) {
+        freopen("/dev/null", "w", stdout);
+    }
+    sim_trace("boot %llu%s", (unsigned long long) boots,
+              SIM_RESET_WATCHDOG == sim_reset_reason() ? " after watchdog reset" : "");
+    sim_energy_boot();
+    sim_motor_boot();
+    sim_scenario_boot();
+    if (0 != options.time_limit_us) {
+        sim_schedule_at(options.time_limit_us, time_limit_reached, NULL);
+    }
+    firmware_main();
+}
+
+/* Builds a factory-fresh device and runs it until the firmware or the scenario stops. */
+static int run(const char *value) {
+    sim_world_reset();
+    sim_time_init(options.realtime);
+    sim_energy_init();
+    sim_eeprom_init(options.image);
+    sim_modem_init();
+    sim_motor_init(options.steps, options.start_step);
+    sim_gpio_init();
+    sim_uart_init();
+    sim_watchdog_init();
+    if (NULL != options.scenario && !sim_scenario_load(options.scenario, options.sweep_var, value)) {
+        return 2;
+    }
+    return sim_world_run(boot);
+}
+
+static double wall_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+static int sweep(void) {
+    uint64_t failed_runs = 0;
+    uint64_t runs = 0;
+    double start = wall_seconds();
+    sweeping = true;
+    sim_trace_enabled = false;
+    for (long v = options.sweep_from; v <= options.sweep_to; v += options.sweep_step) {
+        char value[24];
+        snprintf(value, sizeof(value), "%ld", v);
+        int status = run(value);
+        uint64_t failures = sim_scenario_failures();
+        printf("%s=%s: %s, %llu failed expectations, %llu.%03llu s simulated\n", options.sweep_var, value,
+               0 == status ? "ok" : "stopped", (unsigned long long) failures,
+               (unsigned long long) (sim_time_us() / 1000000u), (unsigned long long) (sim_time_us() / 1000u % 1000u));
+        failed_runs += 0 != status || 0 != failures;
+        runs++;
+    }
+    double elapsed = wall_seconds() - start;
+    printf("%llu runs, %llu failed, %.3f s wall time, %.1f runs/s\n", (unsigned long long) runs,
+           (unsigned long long) failed_runs, elapsed, elapsed > 0 ? (double) runs / elapsed : 0.0);
+    return failed_runs ? 1 : 0;
+}
+
+static bool parse_sweep(const char *spec) {
+    static char var[32];
+    const char *eq = strchr(spec, '=');
+    if (NULL == eq || (size_t) (eq - spec) >= sizeof(var)) {
+        return false;
+    }
+    memcpy(var, spec, (size_t) (eq - spec));
+    var[eq - spec] = '\0';
+    options.sweep_var = var;
+    int n = sscanf(eq + 1, "%ld:%ld:%ld", &options.sweep_from, &options.sweep_to, &options.sweep_step);
+    return n >= 2 && options.sweep_step > 0;
+}
+
+int main(int argc, char **argv) {
+    bool paced = false;
+    long time_limit_s = -1;
+
+    for (int i = 1; i < argc; i++) {
+        if (0 == strcmp(argv[i], "--eeprom") && i + 1 < argc) {
+            options.image = argv[++i];
+        } else if (0 == strcmp(argv[i], "--pills") && i + 1 < argc) {
+            pill_mask = (uint8_t) strtoul(argv[++i], NULL, 0);
+        } else if (0 == strcmp(argv[i], "--steps") && i + 1 < argc) {
+            options.steps = atoi(argv[++i]);
+        } else if (0 == strcmp(argv[i], "--start-step") && i + 1 < argc) {
+            options.start_step = atoi(argv[++i]);
+        } else if (0 == strcmp(argv[i], "--scenario") && i + 1 < argc) {
+            options.scenario = argv[++i];
+        } else if (0 == strcmp(argv[i], "--sweep") && i + 1 < argc && parse_sweep(argv[i + 1])) {
+            i++;
+        } else if (0 == strcmp(argv[i], "--realtime")) {
+            paced = true;
+        } else if (0 == strcmp(argv[i], "--time-limit") && i + 1 < argc) {
+            time_limit_s = atol(argv[++i]);
+        } else if (0 == strcmp(argv[i], "--quiet")) {
+            sim_trace_enabled = false;
+        } else {
+            fprintf(stderr, "usage: %s [--eeprom FILE] [--pills MASK] [--steps N] [--start-step N] [--quiet]\n"
+                            "       [--scenario FILE [--sweep VAR=FROM:TO[:STEP]]] [--realtime] [--time-limit S]\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+    if (NULL != options.sweep_var && NULL == options.scenario) {
+        fprintf(stderr, "sim: --sweep needs a --scenario\n");
+        return 1;
+    }
+
+    /* Interactive runs follow the wall clock; scripted runs go as fast as the host allows. */
+    options.realtime = paced || NULL == options.scenario;
+    if (time_limit_s < 0) {
+        time_limit_s = options.realtime ? 0 : DEFAULT_TIME_LIMIT_S;
+    }
+    options.time_limit_us = (uint64_t) time_limit_s * 1000000u;
+
+    if (NULL != options.sweep_var) {
+        return sweep();
+    }
+
+    double start = wall_seconds();
+    int status = run(NULL);
+    if (2 == status) {
+        return status;
+    }
+    sim_eeprom_save();
+    report(stderr);
+    if (NULL != options.scenario) {
+        fprintf(stderr, "scenario: %llu failed expectations, %.3f s wall time\n",
+                (unsigned long long) sim_scenario_failures(), wall_seconds() - start);
+    }
+    return 0 != status || 0 != sim_scenario_failures() ? 1 : 0;
+}
@@ -0,0 +1,252 @@
+/*
+ * Simulated Seeed LoRa-E5 AT modem on the far end of uart1.
+ *
+ * Commands are executed one at a time in arrival order. Configuration commands answer after a few milliseconds,
+ * AT+JOIN reports the joined network after a few seconds and AT+MSG/AT+MSGHEX report "+MSG: Done" once the uplink's
+ * airtime (SF9/125 kHz, computed with the Semtech formula) and both receive windows have passed. Responses are clocked
+ * back to the UART at the line's baud rate.
+ *
+ * The text of every uplink is kept in a log in shared memory, so scenarios can check what reached the network server
+ * across any number of reboots.
+ */
+#include <math.h>
+#include <string.h>
+
+#include "sim.h"
+
+#include "lorawan.h"
+#include "payload.h"
+
+#define CMD_LATENCY_US 5000
+#define JOIN_TIME_US 4500000
+#define RX_WINDOWS_US 2000000
+#define LORAWAN_OVERHEAD 13
+#define SPREADING_FACTOR 9
+#define BANDWIDTH_HZ 125000
+#define OUT_CHUNKS 16
+#define UPLINK_LOG_SIZE 16384
+
+typedef struct sim_out_chunk {
+    uint64_t at_us;
+    char text[STRLEN];
+} sim_out_chunk;
+
+typedef struct sim_modem_stats {
+    uint64_t commands;
+    uint64_t uplinks;
+    uint64_t payload_bytes;
+    uint64_t airtime_us;
+    uint64_t busy_us;
+    uint64_t sequence_repeats;      // payloads whose sequence number is not ahead of the one before
+} sim_modem_stats;
+
+typedef struct sim_network {
+    sim_modem_stats stats;
+    bool sequenced;                 // a payload sequence number has been seen
+    uint16_t last_sequence;
+    size_t log_len;
+    char log[UPLINK_LOG_SIZE];
+} sim_network;
+
+static char line[600];
+static size_t line_len;
+static bool joined;
+static uint64_t busy_until_us;
+
+static sim_out_chunk outq[OUT_CHUNKS];
+static int out_head;
+static int out_count;
+static size_t out_pos;
+static bool pumping;
+
+static sim_network *network;
+
+/////////////////////////////////////////////////////
+//                  RESPONSE PATH                  //
+/////////////////////////////////////////////////////
+
+static void pump(void *arg) {
+    sim_out_chunk *chunk = &outq[out_head];
+    if (0 == out_count || chunk->at_us > sim_time_us()) {
+        pumping = false;
+        if (out_count > 0) {
+            pumping = true;
+            sim_schedule_at(chunk->at_us, pump, NULL);
+        }
+        return;
+    }
+    sim_uart_rx_push(UART_NR, (uint8_t) chunk->text[out_pos++]);
+    if ('\0' == chunk->text[out_pos]) {
+        out_pos = 0;
+        out_head = (out_head + 1) % OUT_CHUNKS;
+        out_count--;
+    }
+    pumping = true;
+    sim_schedule_in(10u * 1000000u / BAUD_RATE, pump, NULL);
+}
+
+/* Queues a response line to start arriving delay_us after the modem is done with earlier work. */
+static void respond(uint64_t delay_us, const char *text) {
+    if (OUT_CHUNKS == out_count) {
+        return;
+    }
+    uint64_t start = sim_time_us() > busy_until_us ? sim_time_us() : busy_until_us;
+    busy_until_us = start + delay_us;
+    sim_out_chunk *chunk = &outq[(out_head + out_count++) % OUT_CHUNKS];
+    chunk->at_us = busy_until_us;
+    snprintf(chunk->text, sizeof(chunk->text), "%s\r\n", text);
+    if (!pumping) {
+        pumping = true;
+        sim_schedule_at(chunk->at_us, pump, NULL);
+    }
+}
+
+/////////////////////////////////////////////////////
+//                COMMAND HANDLING                 //
+/////////////////////////////////////////////////////
+
+static uint64_t airtime_us(size_t payload) {
+    double t_sym = (double) (1u << SPREADING_FACTOR) / BANDWIDTH_HZ;
+    double pl = (double) (payload + LORAWAN_OVERHEAD);
+    double n = ceil((8.0 * pl - 4.0 * SPREADING_FACTOR + 28.0 + 16.0) / (4.0 * SPREADING_FACTOR)) * 5.0;
+    double symbols = 12.25 + 8.0 + (n > 0 ? n : 0);
+    return (uint64_t) (symbols * t_sym * 1e6);
+}
+
+/* Appends one uplink to the log, dropping the older half of the log when it runs full. */
+static void log_uplink(const char *text, size_t len) {
+    if (len + 2 > UPLINK_LOG_SIZE / 2) {
+        len = UPLINK_LOG_SIZE / 2 - 2;
+    }
+    if (network->log_len + len + 2 > UPLINK_LOG_SIZE) {
+        size_t keep = network->log_len / 2;
+        memmove(network->log, network->log + network->log_len - keep, keep);
+        network->log_len = keep;
+    }
+    memcpy(network->log + network->log_len, text, len);
+    network->log_len += len;
+    network->log[network->log_len++] = '\n';
+    network->log[network->log_len] = '\0';
+}
+
+static void uplink(const char *tag, const char *payload_text, size_t payload) {
+    char text[STRLEN];
+    if (!joined) {
+        snprintf(text, sizeof(text), "+%s: Please join network first", tag);
+        respond(CMD_LATENCY_US, text);
+        return;
+    }
+    uint64_t airtime = airtime_us(payload);
+    log_uplink(payload_text, strlen(payload_text));
+    snprintf(text, sizeof(text), "+%s: Start", tag);
+    respond(CMD_LATENCY_US, text);
+    snprintf(text, sizeof(text), "+%s: Done", tag);
+    respond(airtime + RX_WINDOWS_US, text);
+    network->stats.uplinks++;
+    network->stats.payload_bytes += payload;
+    network->stats.airtime_us += airtime;
+    sim_energy_transmit(airtime);
+    sim_trace("uplink of %zu bytes, %llu ms airtime", payload, (unsigned long long) (airtime / 1000u));
+}
+
+/* Returns the quoted argument of a command such as AT+MSG="text", or an empty string. */
+static const char *quoted(const char *arg, size_t *len) {
+    const char *start = strchr(arg, '"');
+    const char *end = start ? strrchr(start + 1, '"') : NULL;
+    if (NULL == end) {
+        *len = 0;
+        return "";
+    }
+    *len = (size_t) (end - start - 1);
+    return start + 1;
+}
+
+static void execute(const char *cmd) {
+    char text[STRLEN];
+    const char *arg = strchr(cmd, '=');
+    size_t len;
+    uint64_t start = sim_time_us() > busy_until_us ? sim_time_us() : busy_until_us;
+
+    network->stats.commands++;
+    if (0 == strcmp(cmd, "AT")) {
+        respond(CMD_LATENCY_US, "+AT: OK");
+    } else if (0 == strncmp(cmd, "AT+MSGHEX=", 10)) {
+        const char *hex = quoted(arg, &len);
+        payload_event event;
+        snprintf(text, sizeof(text), "%.*s", (int) len, hex);
+        /* log what the network server's decoder would show, so scenarios can expect events by name */
+        if (payloadDecodeHex(text, &event)) {
+            char decoded[STRLEN];
+            payloadFormat(&event, decoded, sizeof(decoded));
+            if (joined) {
+                /* like the network server, which keeps the last number across the device's resets */
+                if (network->sequenced && 0 >= (int16_t) (event.sequence - network->last_sequence)) {
+                    network->stats.sequence_repeats++;
+                    sim_trace("uplink sequence #%u after #%u", event.sequence, network->last_sequence);
+                }
+                network->sequenced = true;
+                network->last_sequence = event.sequence;
+            }
+            uplink("MSGHEX", decoded, len / 2);
+        } else {
+            uplink("MSGHEX", text, len / 2);
+        }
+    } else if (0 == strncmp(cmd, "AT+MSG=", 7)) {
+        const char *msg = quoted(arg, &len);
+        snprintf(text, sizeof(text), "%.*s", (int) len, msg);
+        uplink("MSG", text, len);
+    } else if (0 == strcmp(cmd, "AT+JOIN")) {
+        respond(CMD_LATENCY_US, "+JOIN: Start");
+        respond(0, "+JOIN: NORMAL");
+        respond(JOIN_TIME_US, "+JOIN: Network joined");
+        respond(0, "+JOIN: NetID 000013 DevAddr 26:0B:5F:3A");
+        respond(0, "+JOIN: Done");
+        joined = true;
+    } else if (0 == strncmp(cmd, "AT+KEY=APPKEY,", 14)) {
+        const char *key = quoted(arg, &len);
+        snprintf(text, sizeof(text), "+KEY: %.*s", (int) len, key);
+        respond(CMD_LATENCY_US, text);
+    } else if (0 == strncmp(cmd, "AT+", 3) && NULL != arg) {
+        snprintf(text, sizeof(text), "+%.*s: %s", (int) (arg - cmd - 3), cmd + 3, arg + 1);
+        respond(CMD_LATENCY_US, text);
+    } else {
+        respond(CMD_LATENCY_US, "+AT: ERROR(-1)");
+    }
+    network->stats.busy_us += busy_until_us - start;
+}
+
+void sim_modem_init(void) {
+    network = sim_shared_alloc(sizeof(*network));
+    sim_metric_register("modem_commands", &network->stats.commands);
+    sim_metric_register("uplinks", &network->stats.uplinks);
+    sim_metric_register("uplink_payload_bytes", &network->stats.payload_bytes);
+    sim_metric_register("airtime_us", &network->stats.airtime_us);
+    sim_metric_register("uplink_sequence_repeats", &network->stats.sequence_repeats);
+}
+
+bool sim_modem_uplink_seen(const char *text) {
+    return NULL != strstr(network->log, text);
+}
+
+void sim_modem_receive(uint8_t byte) {
+    if ('\n' == byte) {
+        while (line_len > 0 && '\r' == line[line_len - 1]) {
+            line_len--;
+        }
+        line[line_len] = '\0';
+        line_len = 0;
+        if ('\0' != line[0]) {
+            execute(line);
+        }
+    } else if (line_len < sizeof(line) - 1) {
+        line[line_len++] = (char) byte;
+    }
+}
+
+void sim_modem_report(FILE *out) {
+    const sim_modem_stats *s = &network->stats;
+    fprintf(out, "modem: %llu commands, %llu uplinks carrying %llu payload bytes, %llu ms airtime, %llu ms busy\n",
+            (unsigned long long) s->commands, (unsigned long long) s->uplinks,
+            (unsigned long long) s->payload_bytes, (unsigned long long) (s->airtime_us / 1000u),
+            (unsigned long long) (s->busy_us / 1000u));
+}
@@ -0,0 +1,264 @@
+/*
+ * Simulated dispenser wheel: a half-stepping 28BYJ-48 turning an eight compartment wheel over a single drop hole.
+ *
+ * The rotor follows the coil pattern on IN1..IN4; a pattern one row away in the half-step sequence moves it one step,
+ * anything further is counted as a stall. The optofork output goes low while the slot in the wheel is in the beam, so
+ * each clockwise pass produces one falling edge. Compartment 0 sits over the hole after calibration, which leaves the
+ * wheel ALIGNMENT steps before the slot. The compartments are filled after calibration, just before dispensing starts.
+ * When a loaded compartment reaches the hole its pill drops and knocks the piezo sensor shortly afterwards.
+ *
+ * The rotor only keeps up with the coils within its torque: from standstill it follows up to PULL_IN_RATE steps per
+ * second, and once turning it can speed up by MAX_ACCELERATION up to MAX_RATE. A step beyond that is lost: the coils
+ * move on but the rotor does not, and the rotor is at rest again. Slowing down is not limited. Steps less than
+ * ROTATION_GAP_US apart belong to one rotation, whose duration and step count are kept for the scenarios, along with
+ * the step jitter: the largest change from one step interval to the next within a rotation. The speed profile alone
+ * changes the interval by a few dozen microseconds; more than that is the firmware's timing getting in the way.
+ *
+ * A scenario can make the wheel slip, as a jammed pill would: the rotor keeps up with the coils, but for a number of
+ * steps the wheel does not turn with it. Those steps are counted as stalls too.
+ */
+#include <math.h>
+
+#include "hardware/gpio.h"
+#include "sim.h"
+
+#include "motor.h"
+
+#define SLOT_WIDTH 40
+#define PILL_FALL_US 20000
+#define PIEZO_PULSE_US 200
+#define PULL_IN_RATE 700.0
+#define MAX_RATE 1250.0
+#define MAX_ACCELERATION 6000.0
+#define ROTATION_GAP_US 20000
+
+typedef struct sim_motor_stats {
+    uint64_t steps_cw;
+    uint64_t steps_ccw;
+    uint64_t stalls;
+    uint64_t optofork_edges;
+    uint64_t pills_dropped;
+    uint64_t rotation_us;       // duration of the current or last rotation
+    uint64_t rotation_steps;
+    uint64_t step_jitter_us;
+    uint64_t wheel_position;    // step of the wheel, 0 with the slot at the start of the beam
+} sim_motor_stats;
+
+/* The mechanics keep their state through a reset, so it lives in shared memory. */
+typedef struct sim_wheel {
+    int steps_per_rev;
+    int position;
+    int phase;
+    uint64_t last_step_us;
+    uint64_t rotation_start_us;
+    uint64_t last_interval_us;  // 0 at the start of a rotation
+    uint64_t rotation_uaus;     // charge drawn by the device when the rotation started
+    int rotation_net;           // clockwise steps of the rotation, less the anticlockwise ones
+    bool rotation_ended;        // seen by the energy model already
+    int slip;                   // steps the wheel still stays behind the rotor
+    double rate;                // of the rotor, steps per second; 0 at rest
+    bool pill_loaded[COMPARTMENTS];
+    sim_motor_stats stats;
+} sim_wheel;
+
+static const uint8_t half_step_pattern[8] = {0x1, 0x3, 0x2, 0x6, 0x4, 0xc, 0x8, 0x9};
+
+static sim_wheel *wheel;
+
+static int wrap(int p) {
+    p %= wheel->steps_per_rev;
+    return p < 0 ? p + wheel->steps_per_rev : p;
+}
+
+static int drop_position(int compartment) {
+    int rev = wheel->steps_per_rev;
+    return wrap(rev - ALIGNMENT + compartment * rev / COMPARTMENTS - rev / (4 * COMPARTMENTS));
+}
+
+static void piezo_release(void *arg) {
+    sim_gpio_release(PIEZO);
+}
+
+static void pill_hits_piezo(void *arg) {
+    sim_gpio_drive(PIEZO, false);
+    sim_schedule_in(PIEZO_PULSE_US, piezo_release, NULL);
+}
+
+static void update_optofork(void) {
+    sim_gpio_drive(OPTOFORK, wheel->position >= SLOT_WIDTH);
+}
+
+/* Tells the energy model when the last rotation was a dispense turn, which moved the wheel on by about one
+ * compartment. */
+static void rotation_end(void) {
+    int compartment = wheel->steps_per_rev / COMPARTMENTS;
+    if (!wheel->rotation_ended && 0 != wheel->stats.rotation_steps && wheel->rotation_net > compartment / 2 &&
+        wheel->rotation_net < compartment * 3 / 2) {
+        sim_energy_turn(wheel->rotation_start_us, wheel->rotation_uaus);
+    }
+    wheel->rotation_ended = true;
+}
+
+/* Whether the rotor manages a step now. Updates its speed, and the rotation the step belongs to. */
+static bool rotor_follows(void) {
+    uint64_t now = sim_time_us();
+    uint64_t interval = now - wheel->last_step_us;
+    double rate = 1e6 / (double) (interval ? interval : 1);
+
+    if (interval >= ROTATION_GAP_US || 0 == wheel->stats.rotation_steps) {
+        rotation_end();
+        wheel->rotation_ended = false;
+        wheel->rotation_uaus = sim_energy_charge_uaus();
+        wheel->rotation_net = 0;
+        wheel->rotation_start_us = now;
+        wheel->stats.rotation_steps = 0;
+        wheel->last_interval_us = 0;
+    } else {
+        uint64_t change = interval > wheel->last_interval_us ? interval - wheel->last_interval_us
+                                                             : wheel->last_interval_us - interval;
+        if (0 != wheel->last_interval_us && change > wheel->stats.step_jitter_us) {
+            wheel->stats.step_jitter_us = change;
+        }
+        wheel->last_interval_us = interval;
+    }
+    wheel->last_step_us = now;
+    wheel->stats.rotation_steps++;
+    wheel->stats.rotation_us = now - wheel->rotation_start_us;
+
+    if (rate < PULL_IN_RATE) {
+        wheel->rate = rate;
+        return true;
+    }
+    double reachable = sqrt(wheel->rate * wheel->rate + 2.0 * MAX_ACCELERATION);
+    if (rate > MAX_RATE || rate > reachable) {
+        wheel->rate = 0;
+        return false;
+    }
+    wheel->rate = rate;
+    return true;
+}
+
+static void step(int direction) {
+    sim_motor_stats *stats = &wheel->stats;
+    bool follows = rotor_follows();
+    wheel->rotation_net += direction;
+    if (!follows) {
+        stats->stalls++;
+        sim_trace("rotor lost a step");
+        return;
+    }
+    if (wheel->slip > 0) {
+        wheel->slip--;
+        stats->stalls++;
+        return;
+    }
+    sim_button_reaction();
+    wheel->position = wrap(wheel->position + direction);
+    stats->wheel_position = (uint64_t) wheel->position;
+    if (direction > 0) {
+        stats->steps_cw++;
+        for (int i = 1; i < COMPARTMENTS; i++) {
+            if (wheel->pill_loaded[i] && wheel->position == drop_position(i)) {
+                wheel->pill_loaded[i] = false;
+                stats->pills_dropped++;
+                sim_trace("pill from compartment %d dropped", i);
+                sim_schedule_in(PILL_FALL_US, pill_hits_piezo, NULL);
+            }
+        }
+        if (0 == wheel->position) {
+            stats->optofork_edges++;
+        }
+    } else {
+        stats->steps_ccw++;
+    }
+    update_optofork();
+    sim_scenario_step(stats->steps_cw + stats->steps_ccw);
+}
+
+void sim_motor_init(int steps_per_revolution, int start_position) {
+    wheel = sim_shared_alloc(sizeof(*wheel));
+    wheel->steps_per_rev = steps_per_revolution;
+    wheel->position = wrap(start_position);
+    wheel->stats.wheel_position = (uint64_t) wheel->position;
+    wheel->phase = -1;
+    sim_metric_register("steps_cw", &wheel->stats.steps_cw);
+    sim_metric_register("steps_ccw", &wheel->stats.steps_ccw);
+    sim_metric_register("stalls", &wheel->stats.stalls);
+    sim_metric_register("optofork_edges", &wheel->stats.optofork_edges);
+    sim_metric_register("pills_dropped", &wheel->stats.pills_dropped);
+    sim_metric_register("rotation_us", &wheel->stats.rotation_us);
+    sim_metric_register("rotation_steps", &wheel->stats.rotation_steps);
+    sim_metric_register("wheel_position", &wheel->stats.wheel_position);
+    sim_metric_register("step_jitter_us", &wheel->stats.step_jitter_us);
+}
+
+void sim_motor_boot(void) {
+    update_optofork();
+}
+
+/* Fills compartment i (1..7) if bit i of mask is set. Returns false if the wheel still held pills. */
+bool sim_motor_load(uint8_t mask) {
+    bool empty = true;
+    for (int i = 1; i < COMPARTMENTS; i++) {
+        empty = empty && !wheel->pill_loaded[i];
+    }
+    if (!empty) {
+        return false;
+    }
+    for (int i = 1; i < COMPARTMENTS; i++) {
+        wheel->pill_loaded[i] = 0 != (mask & (1u << i));
+    }
+    sim_trace("wheel loaded with pill mask 0x%02x", mask & 0xfe);
+    return true;
+}
+
+bool sim_motor_turning(void) {
+    return 0 != wheel->stats.rotation_steps && sim_time_us() - wheel->last_step_us < ROTATION_GAP_US;
+}
+
+void sim_motor_slip(int steps) {
+    sim_trace("wheel slips for %d steps", steps);
+    wheel->slip = steps;
+}
+
+void sim_motor_coils_changed(void) {
+    uint8_t pattern = (uint8_t) (sim_gpio_output(IN1) | sim_gpio_output(IN2) << 1 | sim_gpio_output(IN3) << 2 |
+                                 sim_gpio_output(IN4) << 3);
+    sim_energy_coils(__builtin_popcount(pattern));
+    int row = -1;
+    for (int i = 0; i < 8; i++) {
+        if (half_step_pattern[i] == pattern) {
+            row = i;
+        }
+    }
+    if (row < 0 || row == wheel->phase) {
+        return;
+    }
+    int previous = wheel->phase;
+    wheel->phase = row;
+    if (previous >= 0) {
+        int delta = (row - previous + 8) % 8;
+        if (7 == delta) {
+            step(1);
+        } else if (1 == delta) {
+            step(-1);
+        } else {
+            wheel->stats.stalls++;
+        }
+    }
+}
+
+void sim_motor_report(FILE *out) {
+    const sim_motor_stats *stats = &wheel->stats;
+    if (!sim_motor_turning()) {
+        rotation_end();
+    }
+    fprintf(out, "motor: %llu steps clockwise, %llu anticlockwise, %llu stalls, %llu optofork edges, "
+                 "%llu pills dropped, wheel at step %d of %d, last rotation %llu steps in %llu.%03llu ms, "
+                 "%llu us step jitter\n",
+            (unsigned long long) stats->steps_cw, (unsigned long long) stats->steps_ccw,
+            (unsigned long long) stats->stalls, (unsigned long long) stats->optofork_edges,
+            (unsigned long long) stats->pills_dropped, wheel->position, wheel->steps_per_rev,
+            (unsigned long long) stats->rotation_steps, (unsigned long long) (stats->rotation_us / 1000u),
+            (unsigned long long) (stats->rotation_us % 1000u), (unsigned long long) stats->step_jitter_us);
+}
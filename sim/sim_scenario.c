@@ -0,0 +1,364 @@
+/*
+ * Scenario scripts: a timed list of things that happen to the device, with checks on the outcome.
+ *
+ * Each line holds WHEN ACTION [ARGS]; '#' starts a comment. WHEN is an absolute simulated time ("90s", "2h", "1500ms",
+ * "250us", "3d"; a bare number is milliseconds), a time relative to the previous action ("+5s") or a motor step count,
+ * absolute or relative to the previous action ("step:2048", "step:+100"). Actions run one after another in file order:
+ *
+ *   press sw0|sw2 [HOLD_MS]   press and release a button
+ *   load MASK                 fill the compartments selected by MASK (bits 1..7) if the wheel is empty
+ *   power-cycle [OFF_TIME]    cut the power, tearing any EEPROM write in progress, and boot again
+ *   watchdog                  reset the chip as if the watchdog had expired
+ *   i2c-hold                  make the EEPROM hold SDA low until the bus is recovered
+ *   slip STEPS                make the wheel stand still for the next STEPS steps of the motor
+ *   expect METRIC OP VALUE    check a simulator metric, OP is one of == != < <= > >=; VALUE is a number or the
+ *                             name of another metric
+ *   expect-uplink TEXT        check that an uplink containing TEXT has been sent
+ *   end                       stop the simulation
+ *
+ * Occurrences of $NAME are replaced by the value given for NAME on the command line, which is how parameter sweeps
+ * move an action around. The script and its progress live in shared memory so a run continues across reboots.
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "sim.h"
+
+#include "button.h"
+
+#define SCENARIO_MAX_ACTIONS 256
+#define SCENARIO_TEXT 96
+#define DEFAULT_HOLD_MS 200
+
+enum scenario_when {
+    WHEN_AT,
+    WHEN_AFTER,
+    WHEN_STEP,
+    WHEN_STEPS_AFTER,
+};
+
+enum scenario_op {
+    OP_PRESS,
+    OP_LOAD,
+    OP_POWER_CYCLE,
+    OP_WATCHDOG,
+    OP_I2C_HOLD,
+    OP_SLIP,
+    OP_EXPECT,
+    OP_EXPECT_UPLINK,
+    OP_END,
+};
+
+typedef struct sim_action {
+    int line;
+    enum scenario_when when;
+    uint64_t when_value;
+    enum scenario_op op;
+    uint64_t value;
+    uint32_t arg;
+    char compare[3];
+    char text[SCENARIO_TEXT];
+    char reference[SCENARIO_TEXT];  // metric VALUE of an expect, empty for a number
+} sim_action;
+
+typedef struct sim_script {
+    int count;
+    int next;
+    uint64_t last_us;
+    uint64_t last_steps;
+    uint64_t steps;
+    uint64_t failures;
+    sim_action actions[SCENARIO_MAX_ACTIONS];
+} sim_script;
+
+static sim_script *script;
+static const char *script_path;
+static bool waiting_for_steps;
+
+static void arm(void);
+
+/////////////////////////////////////////////////////
+//                     PARSING                     //
+/////////////////////////////////////////////////////
+
+static bool parse_time(const char *s, uint64_t *us) {
+    char *end;
+    uint64_t v = strtoull(s, &end, 10);
+    if (end == s) {
+        return false;
+    }
+    if (0 == strcmp(end, "us")) {
+        *us = v;
+    } else if (0 == strcmp(end, "ms") || '\0' == *end) {
+        *us = v * 1000u;
+    } else if (0 == strcmp(end, "s")) {
+        *us = v * 1000000u;
+    } else if (0 == strcmp(end, "m")) {
+        *us = v * 60000000u;
+    } else if (0 == strcmp(end, "h")) {
+        *us = v * 3600000000u;
+    } else if (0 == strcmp(end, "d")) {
+        *us = v * 86400000000u;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+static bool parse_when(const char *s, sim_action *a) {
+    char *end;
+    if (0 == strncmp(s, "step:", 5)) {
+        s += 5;
+        a->when = '+' == *s ? WHEN_STEPS_AFTER : WHEN_STEP;
+        s += '+' == *s;
+        a->when_value = strtoull(s, &end, 10);
+        return end != s && '\0' == *end;
+    }
+    a->when = '+' == *s ? WHEN_AFTER : WHEN_AT;
+    s += '+' == *s;
+    return parse_time(s, &a->when_value);
+}
+
+/* Copies line into out with every $NAME or ${NAME} replaced by value. */
+static void substitute(const char *line, const char *var, const char *value, char *out, size_t size) {
+    size_t var_len = var ? strlen(var) : 0;
+    size_t n = 0;
+    while ('\0' != *line && n + 1 < size) {
+        bool braced = '$' == line[0] && '{' == line[1];
+        if ('$' == *line && var_len > 0 && 0 == strncmp(line + 1 + braced, var, var_len) &&
+            (!braced || '}' == line[2 + var_len])) {
+            n += (size_t) snprintf(out + n, size - n, "%s", value);
+            line += var_len + 1 + 2 * braced;
+        } else {
+            out[n++] = *line++;
+        }
+    }
+    out[n < size ? n : size - 1] = '\0';
+}
+
+static bool parse_action(char *line, sim_action *a) {
+    char *when = strtok(line, " \t");
+    char *op = strtok(NULL, " \t");
+    char *arg = strtok(NULL, " \t");
+    if (NULL == op || !parse_when(when, a)) {
+        return false;
+    }
+    if (0 == strcmp(op, "press")) {
+        char *hold = strtok(NULL, " \t");
+        a->op = OP_PRESS;
+        if (NULL == arg || (0 != strcmp(arg, "sw0") && 0 != strcmp(arg, "sw2"))) {
+            return false;
+        }
+        a->arg = 0 == strcmp(arg, "sw0") ? SW_0 : SW_2;
+        a->value = hold ? strtoull(hold, NULL, 10) : DEFAULT_HOLD_MS;
+    } else if (0 == strcmp(op, "load")) {
+        a->op = OP_LOAD;
+        if (NULL == arg) {
+            return false;
+        }
+        a->value = strtoull(arg, NULL, 0);
+    } else if (0 == strcmp(op, "power-cycle")) {
+        a->op = OP_POWER_CYCLE;
+        a->value = 1000000u;
+        return NULL == arg || parse_time(arg, &a->value);
+    } else if (0 == strcmp(op, "watchdog")) {
+        a->op = OP_WATCHDOG;
+    } else if (0 == strcmp(op, "i2c-hold")) {
+        a->op = OP_I2C_HOLD;
+    } else if (0 == strcmp(op, "slip")) {
+        a->op = OP_SLIP;
+        if (NULL == arg) {
+            return false;
+        }
+        a->value = strtoull(arg, NULL, 0);
+    } else if (0 == strcmp(op, "expect")) {
+        char *cmp = strtok(NULL, " \t");
+        char *number = strtok(NULL, " \t");
+        char *end;
+        a->op = OP_EXPECT;
+        if (NULL == number || strlen(cmp) >= sizeof(a->compare)) {
+            return false;
+        }
+        snprintf(a->text, sizeof(a->text), "%s", arg);
+        snprintf(a->compare, sizeof(a->compare), "%s", cmp);
+        a->value = strtoull(number, &end, 0);
+        if (end == number || '\0' != *end) {
+            snprintf(a->reference, sizeof(a->reference), "%s", number);
+            end = number + 1;
+        }
+        return end != number && (0 == strcmp(a->compare, "==") || 0 == strcmp(a->compare, "!=") ||
+                                 0 == strcmp(a->compare, "<") || 0 == strcmp(a->compare, "<=") ||
+                                 0 == strcmp(a->compare, ">") || 0 == strcmp(a->compare, ">="));
+    } else if (0 == strcmp(op, "expect-uplink")) {
+        a->op = OP_EXPECT_UPLINK;
+        if (NULL == arg) {
+            return false;
+        }
+        /* The text is the rest of the line, spaces included. */
+        char *rest = strtok(NULL, "");
+        snprintf(a->text, sizeof(a->text), rest ? "%s %s" : "%s", arg, rest);
+    } else if (0 == strcmp(op, "end")) {
+        a->op = OP_END;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+/* Reads a script into shared memory; var and value may be NULL. Reports errors with their line number. */
+bool sim_scenario_load(const char *path, const char *var, const char *value) {
+    FILE *f = fopen(path, "r");
+    if (NULL == f) {
+        perror(path);
+        return false;
+    }
+    script = sim_shared_alloc(sizeof(*script));
+    script_path = path;
+    sim_metric_register("scenario_failures", &script->failures);
+
+    char raw[256];
+    char line[256];
+    int number = 0;
+    bool ok = true;
+    while (ok && NULL != fgets(raw, sizeof(raw), f)) {
+        number++;
+        char *comment = strchr(raw, '#');
+        if (NULL != comment) {
+            *comment = '\0';
+        }
+        substitute(raw, var, value, line, sizeof(line));
+        size_t len = strlen(line);
+        while (len > 0 && strchr(" \t\r\n", line[len - 1])) {
+            line[--len] = '\0';
+        }
+        char *start = line + strspn(line, " \t");
+        if ('\0' == *start) {
+            continue;
+        }
+        if (SCENARIO_MAX_ACTIONS == script->count) {
+            fprintf(stderr, "%s:%d: too many actions\n", path, number);
+            ok = false;
+        } else {
+            sim_action *a = &script->actions[script->count++];
+            a->line = number;
+            if (!parse_action(start, a)) {
+                fprintf(stderr, "%s:%d: cannot parse action\n", path, number);
+                ok = false;
+            }
+        }
+    }
+    fclose(f);
+    return ok;
+}
+
+/////////////////////////////////////////////////////
+//                    EXECUTION                    //
+/////////////////////////////////////////////////////
+
+static bool compare(uint64_t actual, const char *op, uint64_t expected) {
+    if (0 == strcmp(op, "==")) return actual == expected;
+    if (0 == strcmp(op, "!=")) return actual != expected;
+    if (0 == strcmp(op, "<")) return actual < expected;
+    if (0 == strcmp(op, "<=")) return actual <= expected;
+    if (0 == strcmp(op, ">")) return actual > expected;
+    return actual >= expected;
+}
+
+static void fail(const sim_action *a, const char *fmt, uint64_t actual) {
+    script->failures++;
+    fprintf(stderr, "%s:%d: expectation failed: ", script_path, a->line);
+    fprintf(stderr, fmt, a->text, a->compare, (unsigned long long) a->value, (unsigned long long) actual);
+    fputc('\n', stderr);
+}
+
+static void run_action(void *arg) {
+    sim_action *a = &script->actions[script->next++];
+    uint64_t actual;
+    script->last_us = sim_time_us();
+    script->last_steps = script->steps;
+    switch (a->op) {
+        case OP_PRESS:
+            sim_trace("scenario: press %s", SW_0 == a->arg ? "sw0" : "sw2");
+            sim_button_press(a->arg, (uint32_t) a->value);
+            break;
+        case OP_LOAD:
+            sim_motor_load((uint8_t) a->value);
+            break;
+        case OP_POWER_CYCLE:
+            sim_power_cycle(a->value);
+        case OP_WATCHDOG:
+            sim_reboot(SIM_RESET_WATCHDOG);
+        case OP_I2C_HOLD:
+            sim_eeprom_hold_bus();
+            break;
+        case OP_SLIP:
+            sim_motor_slip((int) a->value);
+            break;
+        case OP_EXPECT:
+            if ('\0' != a->reference[0] && !sim_metric_get(a->reference, &a->value)) {
+                sim_action reference = *a;
+                snprintf(reference.text, sizeof(reference.text), "%s", a->reference);
+                fail(&reference, "unknown metric %s", 0);
+            } else if (!sim_metric_get(a->text, &actual)) {
+                fail(a, "unknown metric %s", 0);
+            } else if (!compare(actual, a->compare, a->value)) {
+                fail(a, "%s %s %llu, actual %llu", actual);
+            }
+            break;
+        case OP_EXPECT_UPLINK:
+            if (!sim_modem_uplink_seen(a->text)) {
+                fail(a, "no uplink containing \"%s\"", 0);
+            }
+            break;
+        case OP_END:
+            sim_trace("scenario: end");
+            sim_exit(0);
+    }
+    arm();
+}
+
+/* Schedules the next action, or leaves it to sim_scenario_step() if it waits for the motor. */
+static void arm(void) {
+    waiting_for_steps = false;
+    if (NULL == script || script->next >= script->count) {
+        return;
+    }
+    const sim_action *a = &script->actions[script->next];
+    switch (a->when) {
+        case WHEN_AT:
+            sim_schedule_at(a->when_value, run_action, NULL);
+            break;
+        case WHEN_AFTER:
+            sim_schedule_at(script->last_us + a->when_value, run_action, NULL);
+            break;
+        case WHEN_STEP:
+        case WHEN_STEPS_AFTER:
+            waiting_for_steps = true;
+            break;
+    }
+}
+
+void sim_scenario_boot(void) {
+    arm();
+}
+
+/* Called by the wheel model on every step. Due actions run from the event queue, not from inside gpio_put(). */
+void sim_scenario_step(uint64_t steps) {
+    if (NULL == script) {
+        return;
+    }
+    script->steps = steps;
+    if (!waiting_for_steps) {
+        return;
+    }
+    const sim_action *a = &script->actions[script->next];
+    uint64_t target = WHEN_STEP == a->when ? a->when_value : script->last_steps + a->when_value;
+    if (steps >= target) {
+        waiting_for_steps = false;
+        sim_schedule_in(0, run_action, NULL);
+    }
+}
+
+uint64_t sim_scenario_failures(void) {
+    return NULL == script ? 0 : script->failures;
+}
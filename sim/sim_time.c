@@ -0,0 +1,476 @@
+/*
+ * Simulated clock, event queue and the pico_time API (sleeps, alarms and repeating timers).
+ *
+ * Time only moves when the firmware sleeps, waits in tight_loop_contents() or a model charges time for a bus transfer.
+ * Pending events (timer callbacks, modem bytes, sensor edges) are dispatched in timestamp order as time passes, which
+ * is where the firmware's interrupt handlers run. Normally time jumps straight from one event to the next, so hours of
+ * firmware time pass in milliseconds and every run is deterministic. In realtime mode the clock is paced against the
+ * host's monotonic clock instead, so the simulator can be driven interactively from stdin.
+ *
+ * The clock itself lives in shared memory and keeps running across simulated reboots; the event queue does not.
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pico/stdlib.h"
+#include "sim.h"
+
+#define SIM_MAX_EVENTS 1024
+#define SIM_MAX_ALARMS 32
+#define SIM_SLOT_BITS 10
+
+typedef struct sim_event {
+    uint64_t at_us;
+    uint64_t seq;
+    sim_event_fn fn;
+    void *arg;
+    sim_event_id id;
+    bool live;
+} sim_event;
+
+typedef struct sim_timebase {
+    uint64_t now_us;
+} sim_timebase;
+
+typedef struct sim_alarm {
+    alarm_callback_t callback;
+    void *user_data;
+    sim_event_id event;
+    bool used;
+} sim_alarm;
+
+timer_hw_t sim_timer_hw;
+bool sim_trace_enabled = true;
+
+void sim_command(const char *line);
+
+static sim_event events[SIM_MAX_EVENTS];
+static uint16_t heap[SIM_MAX_EVENTS];
+static uint16_t free_slots[SIM_MAX_EVENTS];
+static int heap_len;
+static int free_len;
+static uint32_t generation = 1;
+static uint64_t seq_counter;
+
+static sim_alarm alarms[SIM_MAX_ALARMS];
+
+static sim_timebase *timebase;
+static bool realtime;
+static struct timespec wall_start;
+static bool input_open;
+static char input_line[128];
+static size_t input_len;
+
+/////////////////////////////////////////////////////
+//                 EVENT QUEUE                     //
+/////////////////////////////////////////////////////
+
+static bool event_before(int a, int b) {
+    if (events[a].at_us != events[b].at_us) {
+        return events[a].at_us < events[b].at_us;
+    }
+    return events[a].seq < events[b].seq;
+}
+
+static void heap_swap(int i, int j) {
+    uint16_t tmp = heap[i];
+    heap[i] = heap[j];
+    heap[j] = tmp;
+}
+
+static void heap_push(uint16_t slot) {
+    int i = heap_len++;
+    heap[i] = slot;
+    while (i > 0 && event_before(heap[i], heap[(i - 1) / 2])) {
+        heap_swap(i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+static uint16_t heap_pop(void) {
+    uint16_t top = heap[0];
+    heap[0] = heap[--heap_len];
+    int i = 0;
+    for (;;) {
+        int smallest = i;
+        int left = 2 * i + 1;
+        int right = left + 1;
+        if (left < heap_len && event_before(heap[left], heap[smallest])) smallest = left;
+        if (right < heap_len && event_before(heap[right], heap[smallest])) smallest = right;
+        if (smallest == i) break;
+        heap_swap(i, smallest);
+        i = smallest;
+    }
+    return top;
+}
+
+/* Returns the slot of the earliest live event, dropping cancelled ones on the way, or -1 if the queue is empty. */
+static int queue_peek(void) {
+    while (heap_len > 0 && !events[heap[0]].live) {
+        free_slots[free_len++] = heap_pop();
+    }
+    return heap_len > 0 ? heap[0] : -1;
+}
+
+sim_event_id sim_schedule_at(uint64_t at_us, sim_event_fn fn, void *arg) {
+    if (0 == free_len) {
+        fprintf(stderr, "sim: event queue overflow\n");
+        sim_exit(2);
+    }
+    uint16_t slot = free_slots[--free_len];
+    if (at_us < timebase->now_us) {
+        at_us = timebase->now_us;
+    }
+    events[slot] = (sim_event) {
+            .at_us = at_us,
+            .seq = seq_counter++,
+            .fn = fn,
+            .arg = arg,
+            .id = (generation++ << SIM_SLOT_BITS) | slot,
+            .live = true,
+    };
+    if (0 == (generation & ((1u << (32 - SIM_SLOT_BITS)) - 1))) {
+        generation = 1;
+    }
+    heap_push(slot);
+    return events[slot].id;
+}
+
+sim_event_id sim_schedule_in(uint64_t delay_us, sim_event_fn fn, void *arg) {
+    return sim_schedule_at(timebase->now_us + delay_us, fn, arg);
+}
+
+void sim_cancel(sim_event_id id) {
+    if (SIM_NO_EVENT == id) {
+        return;
+    }
+    sim_event *ev = &events[id & ((1u << SIM_SLOT_BITS) - 1)];
+    if (ev->id == id) {
+        ev->live = false;
+    }
+}
+
+static void dispatch_due(void) {
+    int slot;
+    while ((slot = queue_peek()) >= 0 && events[slot].at_us <= timebase->now_us) {
+        heap_pop();
+        sim_event ev = events[slot];
+        events[slot].live = false;
+        free_slots[free_len++] = slot;
+        sim_energy_event();
+        ev.fn(ev.arg);
+    }
+}
+
+/////////////////////////////////////////////////////
+//                 PACING AND INPUT                //
+/////////////////////////////////////////////////////
+
+static uint64_t wall_elapsed_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) (ts.tv_sec - wall_start.tv_sec) * 1000000u + (ts.tv_nsec - wall_start.tv_nsec) / 1000;
+}
+
+static void read_input(void) {
+    char chunk[64];
+    ssize_t n = read(STDIN_FILENO, chunk, sizeof(chunk));
+    if (n <= 0) {
+        if (0 == n || EINTR != errno) {
+            input_open = false;
+        }
+        return;
+    }
+    for (ssize_t i = 0; i < n; i++) {
+        if ('\n' == chunk[i] || input_len == sizeof(input_line) - 1) {
+            input_line[input_len] = '\0';
+            input_len = 0;
+            sim_command(input_line);
+        } else if ('\r' != chunk[i]) {
+            input_line[input_len++] = chunk[i];
+        }
+    }
+}
+
+/* Waits until the wall clock catches up with simulated time target_us. Returns true if stdin input arrived first, in
+ * which case the clock has been moved to the moment of arrival and the caller must re-check the event queue. */
+static bool pace_to(uint64_t target_us) {
+    while (realtime) {
+        uint64_t wall = wall_elapsed_us();
+        if (wall >= target_us) {
+            return false;
+        }
+        if (!input_open) {
+            struct timespec ts = {(time_t) ((target_us - wall) / 1000000u), (long) ((target_us - wall) % 1000000u) * 1000};
+            nanosleep(&ts, NULL);
+            continue;
+        }
+        struct pollfd pfd = {.fd = STDIN_FILENO, .events = POLLIN};
+        int timeout_ms = (int) ((target_us - wall + 999) / 1000);
+        if (poll(&pfd, 1, timeout_ms) > 0) {
+            wall = wall_elapsed_us();
+            if (wall > timebase->now_us) {
+                timebase->now_us = wall < target_us ? wall : target_us;
+            }
+            read_input();
+            return true;
+        }
+    }
+    return false;
+}
+
+static void run_until(uint64_t target_us) {
+    for (;;) {
+        sim_uart_sync();
+        dispatch_due();
+        if (timebase->now_us >= target_us) {
+            return;
+        }
+        uint64_t next = target_us;
+        int slot = queue_peek();
+        if (slot >= 0 && events[slot].at_us < next) {
+            next = events[slot].at_us;
+        }
+        if (!pace_to(next)) {
+            timebase->now_us = next;
+        }
+    }
+}
+
+/////////////////////////////////////////////////////
+//                  SIMULATOR API                  //
+/////////////////////////////////////////////////////
+
+void sim_time_init(bool paced) {
+    timebase = sim_shared_alloc(sizeof(*timebase));
+    realtime = paced;
+    input_open = paced;
+    heap_len = 0;
+    free_len = 0;
+    for (int i = SIM_MAX_EVENTS - 1; i >= 0; i--) {
+        free_slots[free_len++] = (uint16_t) i;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &wall_start);
+}
+
+uint64_t sim_time_us(void) {
+    return timebase->now_us;
+}
+
+/* Moves the clock forward without running anything, e.g. while the device is unpowered. */
+void sim_time_skip_us(uint64_t us) {
+    timebase->now_us += us;
+}
+
+void sim_advance_us(uint64_t us) {
+    run_until(timebase->now_us + us);
+}
+
+/* Lets time run to the next pending event, or blocks on stdin if nothing is scheduled at all. */
+void sim_idle(void) {
+    int slot = queue_peek();
+    if (slot >= 0) {
+        run_until(events[slot].at_us);
+    } else if (input_open) {
+        while (input_open && queue_peek() < 0) {
+            pace_to(wall_elapsed_us() + 1000000u);
+        }
+        dispatch_due();
+    } else {
+        sim_trace("nothing left to simulate");
+        sim_exit(0);
+    }
+}
+
+void sim_trace(const char *fmt, ...) {
+    if (!sim_trace_enabled) {
+        return;
+    }
+    va_list args;
+    va_start(args, fmt);
+    fprintf(stderr, "[%6llu.%06llu] ", (unsigned long long) (timebase->now_us / 1000000u), (unsigned long long) (timebase->now_us % 1000000u));
+    vfprintf(stderr, fmt, args);
+    fputc('\n', stderr);
+    va_end(args);
+}
+
+/////////////////////////////////////////////////////
+//               PICO_TIME FUNCTIONS               //
+/////////////////////////////////////////////////////
+
+uint32_t time_us_32(void) {
+    return (uint32_t) timebase->now_us;
+}
+
+uint64_t time_us_64(void) {
+    return timebase->now_us;
+}
+
+absolute_time_t get_absolute_time(void) {
+    return timebase->now_us;
+}
+
+uint32_t to_ms_since_boot(absolute_time_t t) {
+    return (uint32_t) (t / 1000u);
+}
+
+uint64_t to_us_since_boot(absolute_time_t t) {
+    return t;
+}
+
+absolute_time_t make_timeout_time_ms(uint32_t ms) {
+    return timebase->now_us + (uint64_t) ms * 1000u;
+}
+
+int64_t absolute_time_diff_us(absolute_time_t from, absolute_time_t to) {
+    return (int64_t) (to - from);
+}
+
+const absolute_time_t at_the_end_of_time = INT64_MAX;
+
+/* The SDK sleeps in WFE between the timer interrupts, so the core draws its sleep current meanwhile. */
+static void sleep_to(uint64_t target_us) {
+    sim_energy_cpu_sleep(true);
+    run_until(target_us);
+    sim_energy_cpu_sleep(false);
+}
+
+void sleep_us(uint64_t us) {
+    sleep_to(timebase->now_us + us);
+}
+
+void sleep_ms(uint32_t ms) {
+    sleep_to(timebase->now_us + (uint64_t) ms * 1000u);
+}
+
+void sleep_until(absolute_time_t target) {
+    if (target > timebase->now_us) {
+        sleep_to(target);
+    }
+}
+
+/* Like the SDK on a core with interrupts: returns once something happened (here: the next event ran) or the timeout
+ * passed, true in the latter case. Waiting until the end of time with nothing scheduled ends the simulation. */
+bool best_effort_wfe_or_timeout(absolute_time_t timeout_timestamp) {
+    if (timebase->now_us >= timeout_timestamp) {
+        return true;
+    }
+    int slot = queue_peek();
+    if (slot < 0 && at_the_end_of_time == timeout_timestamp) {
+        sim_idle();
+        return false;
+    }
+    sleep_to(slot >= 0 && events[slot].at_us < timeout_timestamp ? events[slot].at_us : timeout_timestamp);
+    return timebase->now_us >= timeout_timestamp;
+}
+
+void __wfi(void) {
+    int slot = queue_peek();
+    if (slot < 0) {
+        sim_idle();
+        return;
+    }
+    sleep_to(events[slot].at_us);
+}
+
+void busy_wait_us(uint64_t delay_us) {
+    sim_advance_us(delay_us);
+}
+
+void busy_wait_ms(uint32_t delay_ms) {
+    sim_advance_us((uint64_t) delay_ms * 1000u);
+}
+
+void tight_loop_contents(void) {
+    sim_idle();
+}
+
+static void alarm_fire(void *arg) {
+    sim_alarm *alarm = arg;
+    alarm->event = SIM_NO_EVENT;
+    int64_t again = alarm->callback((alarm_id_t) (alarm - alarms) + 1, alarm->user_data);
+    if (0 == again) {
+        alarm->used = false;
+    } else {
+        alarm->event = sim_schedule_in((uint64_t) (again < 0 ? -again : again), alarm_fire, alarm);
+    }
+}
+
+/* Like the SDK, an alarm whose time has passed already, as one 0 us away has, runs its callback right away in the
+ * caller's context if fire_if_past is set, and is only added if the callback asks to run again. */
+alarm_id_t add_alarm_in_us(uint64_t us, alarm_callback_t callback, void *user_data, bool fire_if_past) {
+    for (int i = 0; i < SIM_MAX_ALARMS; i++) {
+        if (!alarms[i].used) {
+            alarms[i] = (sim_alarm) {.callback = callback, .user_data = user_data, .used = true};
+            if (0 == us) {
+                int64_t again = fire_if_past ? callback(i + 1, user_data) : 0;
+                if (0 == again || !alarms[i].used) {
+                    alarms[i].used = false;
+                    return 0;
+                }
+                us = (uint64_t) (again < 0 ? -again : again);
+            }
+            alarms[i].event = sim_schedule_in(us, alarm_fire, &alarms[i]);
+            return i + 1;
+        }
+    }
+    return -1;
+}
+
+alarm_id_t add_alarm_in_ms(uint32_t ms, alarm_callback_t callback, void *user_data, bool fire_if_past) {
+    return add_alarm_in_us((uint64_t) ms * 1000u, callback, user_data, fire_if_past);
+}
+
+alarm_id_t add_alarm_at(absolute_time_t time, alarm_callback_t callback, void *user_data, bool fire_if_past) {
+    return add_alarm_in_us(time > timebase->now_us ? time - timebase->now_us : 0, callback, user_data, fire_if_past);
+}
+
+bool cancel_alarm(alarm_id_t alarm_id) {
+    if (alarm_id <= 0 || alarm_id > SIM_MAX_ALARMS || !alarms[alarm_id - 1].used) {
+        return false;
+    }
+    sim_cancel(alarms[alarm_id - 1].event);
+    alarms[alarm_id - 1].used = false;
+    return true;
+}
+
+static void repeating_timer_fire(void *arg) {
+    struct repeating_timer *rt = arg;
+    rt->alarm_id = 0;
+    if (rt->callback(rt)) {
+        uint64_t period = (uint64_t) (rt->delay_us < 0 ? -rt->delay_us : rt->delay_us);
+        rt->alarm_id = (alarm_id_t) sim_schedule_in(period, repeating_timer_fire, rt);
+    }
+}
+
+bool add_repeating_timer_us(int64_t delay_us, repeating_timer_callback_t callback, void *user_data,
+                            struct repeating_timer *out) {
+    out->delay_us = delay_us;
+    out->pool = NULL;
+    out->callback = callback;
+    out->user_data = user_data;
+    out->alarm_id = (alarm_id_t) sim_schedule_in((uint64_t) (delay_us < 0 ? -delay_us : delay_us),
+                                                 repeating_timer_fire, out);
+    return true;
+}
+
+bool add_repeating_timer_ms(int32_t delay_ms, repeating_timer_callback_t callback, void *user_data,
+                            struct repeating_timer *out) {
+    return add_repeating_timer_us((int64_t) delay_ms * 1000, callback, user_data, out);
+}
+
+bool cancel_repeating_timer(struct repeating_timer *timer) {
+    bool active = 0 != timer->alarm_id;
+    sim_cancel((sim_event_id) timer->alarm_id);
+    timer->alarm_id = 0;
+    return active;
+}
+
+bool stdio_init_all(void) {
+    return true;
+}
@@ -0,0 +1,181 @@
+/*
+ * Simulated PL011 UARTs with 32 byte FIFOs, byte timing at the configured baud rate and level-triggered RX/TX
+ * interrupts. Bytes leaving uart1 go to the LoRa modem model, the modem's responses come back through
+ * sim_uart_rx_push().
+ */
+#include <string.h>
+
+#include "hardware/uart.h"
+#include "sim.h"
+
+#include "lorawan.h"
+
+#define FIFO_DEPTH 32
+#define DR_IDLE 0xffffffffu
+
+typedef struct sim_fifo {
+    uint8_t data[FIFO_DEPTH];
+    int head;
+    int count;
+} sim_fifo;
+
+typedef struct sim_uart_stats {
+    uint64_t tx_bytes;
+    uint64_t rx_bytes;
+    uint64_t rx_overruns;
+    uint64_t tx_overruns;
+} sim_uart_stats;
+
+struct uart_inst {
+    uart_hw_t hw;
+    uint index;
+    uint irqn;
+    uint baudrate;
+    sim_fifo rx;
+    sim_fifo tx;
+    bool shifting;
+    sim_uart_stats *stats;
+};
+
+uart_inst_t sim_uart0_inst = {.hw = {.dr = DR_IDLE}, .index = 0, .irqn = UART0_IRQ};
+uart_inst_t sim_uart1_inst = {.hw = {.dr = DR_IDLE}, .index = 1, .irqn = UART1_IRQ};
+
+static bool fifo_put(sim_fifo *f, uint8_t byte) {
+    if (FIFO_DEPTH == f->count) {
+        return false;
+    }
+    f->data[(f->head + f->count++) % FIFO_DEPTH] = byte;
+    return true;
+}
+
+static uint8_t fifo_get(sim_fifo *f) {
+    uint8_t byte = f->data[f->head];
+    f->head = (f->head + 1) % FIFO_DEPTH;
+    f->count--;
+    return byte;
+}
+
+static uint64_t byte_time_us(const uart_inst_t *u) {
+    return 10u * 1000000u / (u->baudrate ? u->baudrate : BAUD_RATE);
+}
+
+static void update_irq(uart_inst_t *u) {
+    bool rx = (u->hw.imsc & (1u << UART_UARTIMSC_RXIM_LSB)) && u->rx.count > 0;
+    bool tx = (u->hw.imsc & (1u << UART_UARTIMSC_TXIM_LSB)) && u->tx.count < FIFO_DEPTH;
+    if (rx || tx) {
+        sim_irq_raise(u->irqn);
+    }
+}
+
+static void shift_out(void *arg) {
+    uart_inst_t *u = arg;
+    uint8_t byte = fifo_get(&u->tx);
+    u->stats->tx_bytes++;
+    if (UART_NR == u->index) {
+        sim_modem_receive(byte);
+    }
+    if (u->tx.count > 0) {
+        sim_schedule_in(byte_time_us(u), shift_out, u);
+    } else {
+        u->shifting = false;
+    }
+    update_irq(u);
+}
+
+/* Moves a byte the firmware stored in the data register into the TX FIFO. */
+static void commit_dr(uart_inst_t *u) {
+    if (DR_IDLE == u->hw.dr) {
+        return;
+    }
+    if (!fifo_put(&u->tx, (uint8_t) u->hw.dr)) {
+        u->stats->tx_overruns++;
+    }
+    u->hw.dr = DR_IDLE;
+    if (!u->shifting) {
+        u->shifting = true;
+        sim_schedule_in(byte_time_us(u), shift_out, u);
+    }
+}
+
+void sim_uart_sync(void) {
+    commit_dr(uart0);
+    commit_dr(uart1);
+}
+
+void sim_uart_rx_push(uint index, uint8_t byte) {
+    uart_inst_t *u = index ? uart1 : uart0;
+    if (fifo_put(&u->rx, byte)) {
+        u->stats->rx_bytes++;
+    } else {
+        u->stats->rx_overruns++;
+    }
+    update_irq(u);
+}
+
+void sim_uart_init(void) {
+    uart0->stats = sim_shared_alloc(sizeof(sim_uart_stats));
+    uart1->stats = sim_shared_alloc(sizeof(sim_uart_stats));
+    sim_metric_register("uart_tx_bytes", &uart1->stats->tx_bytes);
+    sim_metric_register("uart_rx_bytes", &uart1->stats->rx_bytes);
+    sim_metric_register("uart_rx_overruns", &uart1->stats->rx_overruns);
+}
+
+void sim_uart_report(FILE *out) {
+    for (int i = 0; i < 2; i++) {
+        const sim_uart_stats *s = (i ? uart1 : uart0)->stats;
+        if (0 == s->tx_bytes + s->rx_bytes) {
+            continue;
+        }
+        fprintf(out, "uart%d: %llu bytes sent, %llu received, %llu rx overruns, %llu tx overruns\n", i,
+                (unsigned long long) s->tx_bytes, (unsigned long long) s->rx_bytes,
+                (unsigned long long) s->rx_overruns, (unsigned long long) s->tx_overruns);
+    }
+}
+
+/////////////////////////////////////////////////////
+//                 HARDWARE_UART                   //
+/////////////////////////////////////////////////////
+
+uint uart_init(uart_inst_t *uart, uint baudrate) {
+    uart->baudrate = baudrate;
+    uart->hw.imsc = 0;
+    uart->hw.dr = DR_IDLE;
+    memset(&uart->rx, 0, sizeof(uart->rx));
+    return baudrate;
+}
+
+uint uart_get_index(uart_inst_t *uart) {
+    return uart->index;
+}
+
+uart_hw_t *uart_get_hw(uart_inst_t *uart) {
+    return &uart->hw;
+}
+
+void uart_set_irq_enables(uart_inst_t *uart, bool rx_has_data, bool tx_needs_data) {
+    commit_dr(uart);
+    uart->hw.imsc = (rx_has_data ? 1u << UART_UARTIMSC_RXIM_LSB | 1u << UART_UARTIMSC_RTIM_LSB : 0) |
+                    (tx_needs_data ? 1u << UART_UARTIMSC_TXIM_LSB : 0);
+    update_irq(uart);
+}
+
+bool uart_is_readable(uart_inst_t *uart) {
+    commit_dr(uart);
+    return uart->rx.count > 0;
+}
+
+bool uart_is_writable(uart_inst_t *uart) {
+    commit_dr(uart);
+    return uart->tx.count < FIFO_DEPTH;
+}
+
+char uart_getc(uart_inst_t *uart) {
+    commit_dr(uart);
+    return uart->rx.count > 0 ? (char) fifo_get(&uart->rx) : 0;
+}
+
+void uart_putc_raw(uart_inst_t *uart, char c) {
+    commit_dr(uart);
+    uart->hw.dr = (uint8_t) c;
+    commit_dr(uart);
+}
@@ -0,0 +1,42 @@
+/*
+ * Simulated watchdog. Enabling or feeding it moves the expiry event; if it ever fires the simulated board resets and
+ * the next boot sees watchdog_caused_reboot().
+ */
+#include "hardware/watchdog.h"
+#include "sim.h"
+
+static uint64_t timeout_us;
+static sim_event_id expiry = SIM_NO_EVENT;
+static uint64_t *feeds;
+
+static void watchdog_expired(void *arg) {
+    expiry = SIM_NO_EVENT;
+    sim_reboot(SIM_RESET_WATCHDOG);
+}
+
+void sim_watchdog_init(void) {
+    feeds = sim_shared_alloc(sizeof(*feeds));
+    sim_metric_register("watchdog_feeds", feeds);
+}
+
+void watchdog_enable(uint32_t delay_ms, bool pause_on_debug) {
+    timeout_us = (uint64_t) delay_ms * 1000u;
+    watchdog_update();
+}
+
+void watchdog_update(void) {
+    if (0 == timeout_us) {
+        return;
+    }
+    (*feeds)++;
+    sim_cancel(expiry);
+    expiry = sim_schedule_in(timeout_us, watchdog_expired, NULL);
+}
+
+bool watchdog_caused_reboot(void) {
+    return SIM_RESET_WATCHDOG == sim_reset_reason();
+}
+
+void sim_watchdog_report(FILE *out) {
+    fprintf(out, "watchdog: %llu feeds\n", (unsigned long long) *feeds);
+}
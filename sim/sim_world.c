@@ -0,0 +1,149 @@
+/*
+ * Simulated power domain: every boot of the firmware runs in a forked child of the simulator process, so the
+ * firmware's globals start from their initial values exactly like after a real reset. Everything that outlives a reset
+ * (the EEPROM array, the wheel, the clock, statistics, scenario progress) is allocated from a shared arena that the
+ * children inherit.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "sim.h"
+
+#define SIM_ARENA_SIZE (1u << 20)
+#define SIM_MAX_METRICS 48
+
+typedef struct sim_metric {
+    const char *name;
+    const uint64_t *value;
+} sim_metric;
+
+typedef struct sim_power {
+    enum sim_reset_reason reason;
+    uint64_t boots;
+    uint64_t power_cycles;
+    uint64_t watchdog_resets;
+} sim_power;
+
+static uint8_t *arena;
+static size_t arena_used;
+static sim_metric metrics[SIM_MAX_METRICS];
+static int metric_count;
+static sim_power *power;
+
+void *sim_shared_alloc(size_t size) {
+    if (NULL == arena) {
+        arena = mmap(NULL, SIM_ARENA_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (MAP_FAILED == arena) {
+            perror("sim: mmap");
+            exit(2);
+        }
+    }
+    size = (size + 15u) & ~(size_t) 15u;
+    if (arena_used + size > SIM_ARENA_SIZE) {
+        fprintf(stderr, "sim: shared arena exhausted\n");
+        exit(2);
+    }
+    void *p = arena + arena_used;
+    arena_used += size;
+    return p;
+}
+
+/* Wipes all shared state so the next run starts from a factory-fresh device. Models must be initialised again. */
+void sim_world_reset(void) {
+    if (NULL != arena) {
+        memset(arena, 0, arena_used);
+    }
+    arena_used = 0;
+    metric_count = 0;
+    power = sim_shared_alloc(sizeof(*power));
+    sim_metric_register("boots", &power->boots);
+    sim_metric_register("power_cycles", &power->power_cycles);
+    sim_metric_register("watchdog_resets", &power->watchdog_resets);
+}
+
+void sim_metric_register(const char *name, const uint64_t *value) {
+    if (metric_count < SIM_MAX_METRICS) {
+        metrics[metric_count++] = (sim_metric) {name, value};
+    }
+}
+
+bool sim_metric_get(const char *name, uint64_t *value) {
+    if (0 == strcmp(name, "time_s")) {
+        *value = sim_time_us() / 1000000u;
+        return true;
+    }
+    for (int i = 0; i < metric_count; i++) {
+        if (0 == strcmp(metrics[i].name, name)) {
+            *value = *metrics[i].value;
+            return true;
+        }
+    }
+    return false;
+}
+
+enum sim_reset_reason sim_reset_reason(void) {
+    return power->reason;
+}
+
+void sim_world_report(FILE *out) {
+    fprintf(out, "power: %llu boots, %llu power cycles, %llu watchdog resets\n", (unsigned long long) power->boots,
+            (unsigned long long) power->power_cycles, (unsigned long long) power->watchdog_resets);
+}
+
+void sim_exit(int status) {
+    fflush(stdout);
+    fflush(stderr);
+    _exit(status);
+}
+
+/* Cuts the power for off_us. A write cycle the EEPROM was in the middle of is torn. */
+void sim_power_cycle(uint64_t off_us) {
+    power->reason = SIM_RESET_POWER_ON;
+    power->power_cycles++;
+    sim_trace("power lost");
+    sim_eeprom_power_loss();
+    sim_energy_reset(true);
+    sim_time_skip_us(off_us);
+    sim_exit(SIM_EXIT_REBOOT);
+}
+
+void sim_reboot(enum sim_reset_reason reason) {
+    if (SIM_RESET_POWER_ON == reason) {
+        sim_power_cycle(0);
+    }
+    power->reason = reason;
+    power->watchdog_resets++;
+    sim_trace("reset by watchdog");
+    sim_energy_reset(false);
+    sim_exit(SIM_EXIT_REBOOT);
+}
+
+/* Boots the firmware again and again until it stops for a reason other than a reset. Returns that exit status. */
+int sim_world_run(void (*boot)(void)) {
+    for (;;) {
+        fflush(NULL);
+        pid_t pid = fork();
+        if (pid < 0) {
+            perror("sim: fork");
+            return 2;
+        }
+        if (0 == pid) {
+            power->boots++;
+            boot();
+            sim_exit(0);
+        }
+        int status;
+        while (waitpid(pid, &status, 0) < 0) {
+        }
+        if (WIFSIGNALED(status)) {
+            fprintf(stderr, "sim: firmware died with signal %d\n", WTERMSIG(status));
+            return 2;
+        }
+        if (SIM_EXIT_REBOOT != WEXITSTATUS(status)) {
+            return WEXITSTATUS(status);
+        }
+    }
+}
@@ -1,4 +1,6 @@
 #include "state.h"
+#include <stddef.h>
+#include <stdlib.h>
 #include <string.h>
 #include "hardware/i2c.h"
 #include "pico/stdlib.h"
@@ -6,9 +8,12 @@
 #define I2C_SDA 16
 #define I2C_SCL 17
 #define DEVADDR 0x50
-#define BAUDRATE 100000
-#define I2C_MEMORY_SIZE 32768
+#define I2C_RETRIES 3               // attempts per EEPROM operation
+#define I2C_FALLBACK_ERRORS 3       // failed transfers in a row that make the bus drop to the next slower speed
+#define I2C_TIMEOUT_MARGIN_US 500   // added to twice the time a transfer takes on the wire
+#define I2C_RECOVERY_CLOCKS 9
 #define STATE_MEMORY_ADDRESS 0x0000
+#define READ_CHUNK 16
 
 #ifdef DEBUG_PRINT
 #define DEBUG_PRINT(fmt, ...)  printf((fmt), ##__VA_ARGS__)
@@ -17,44 +22,498 @@
 #endif
 
 
-extern int * log_counter;
+// Bus speeds from the fastest down. eepromInit() uses the fastest one the EEPROM answers at, and the bus falls back to
+// the next one when transfers keep failing.
+static const uint32_t i2c_baudrates[] = {1000000, 400000, 100000};
+#define I2C_BAUDRATES ( sizeof(i2c_baudrates) / sizeof(i2c_baudrates[0]) )
 
+static struct {
+    unsigned speed;             // index into i2c_baudrates
+    int failures;               // failed transfers in a row
+    eeprom_bus_stats stats;
+} eeprom_bus;
+
+static void busSetSpeed(unsigned speed) {
+    eeprom_bus.speed = speed;
+    eeprom_bus.failures = 0;
+    eeprom_bus.stats.baudrate = i2c_set_baudrate(i2c0, i2c_baudrates[speed]);
+}
+
+// A device that lost the master in the middle of a read keeps SDA low and waits for more clocks. Clocking SCL by hand
+// until it lets go of SDA, then sending a STOP, frees the bus again. The lines are open-drain: a line is pulled low by
+// driving a 0 and let go by making it an input for the pull-up to take high, as driving it high would short a device
+// holding it low. The controller may still be stuck in the transfer the device broke off, so it is reset afterwards.
+static void busLine(uint gpio, bool high) {
+    gpio_set_dir(gpio, true == high ? GPIO_IN : GPIO_OUT);
+}
+
+static void busRecover() {
+    eeprom_bus.stats.recoveries++;
+    DEBUG_PRINT("I2C bus stuck, recovering.\n");
+
+    gpio_set_dir(I2C_SDA, GPIO_IN);
+    gpio_set_dir(I2C_SCL, GPIO_IN);
+    gpio_put(I2C_SDA, false);
+    gpio_put(I2C_SCL, false);
+    gpio_set_function(I2C_SDA, GPIO_FUNC_SIO);
+    gpio_set_function(I2C_SCL, GPIO_FUNC_SIO);
+    for (int clock = 0; clock < I2C_RECOVERY_CLOCKS && false == gpio_get(I2C_SDA); clock++) {
+        busLine(I2C_SCL, false);
+        sleep_us(5);
+        busLine(I2C_SCL, true);
+        sleep_us(5);
+    }
+    // STOP: SDA rises while SCL is high
+    busLine(I2C_SDA, false);
+    sleep_us(5);
+    busLine(I2C_SDA, true);
+    sleep_us(5);
+    eeprom_bus.stats.baudrate = i2c_init(i2c0, i2c_baudrates[eeprom_bus.speed]);
+    gpio_set_function(I2C_SDA, GPIO_FUNC_I2C);
+    gpio_set_function(I2C_SCL, GPIO_FUNC_I2C);
+}
+
+// Twice the time length bytes plus the address byte take on the wire at the current speed, and some slack for the
+// interrupt latency.
+static uint busTimeout(size_t length) {
+    uint32_t bits = (uint32_t) (length + 1) * 9 + 2;
+    return (uint) (2 * bits * 1000000u / eeprom_bus.stats.baudrate + I2C_TIMEOUT_MARGIN_US);
+}
+
+// Books a finished transfer. A timeout means the bus hangs and is recovered right away; NACKs are expected while the
+// device runs a write cycle and only count as errors for reads and writes. Too many failures in a row and the bus
+// falls back to the next slower speed.
+static int busDone(eeprom_op_stats *op, int result, uint64_t started_us, bool nack_is_error) {
+    uint32_t latency = (uint32_t) (time_us_64() - started_us);
+    op->count++;
+    op->total_us += latency;
+    if (latency > op->max_us) {
+        op->max_us = latency;
+    }
+
+    if (PICO_ERROR_TIMEOUT == result) {
+        op->timeouts++;
+        busRecover();
+    } else if (0 > result && true == nack_is_error) {
+        op->errors++;
+    } else {
+        eeprom_bus.failures = 0;
+        return result;
+    }
+    if (++eeprom_bus.failures >= I2C_FALLBACK_ERRORS && eeprom_bus.speed + 1 < I2C_BAUDRATES) {
+        busSetSpeed(eeprom_bus.speed + 1);
+        eeprom_bus.stats.fallbacks++;
+        DEBUG_PRINT("I2C falls back to %u Hz.\n", (unsigned) eeprom_bus.stats.baudrate);
+    }
+    return result;
+}
+
+static int busWrite(const uint8_t *data, size_t length, bool nostop) {
+    uint64_t started_us = time_us_64();
+    int result = i2c_write_timeout_us(i2c0, DEVADDR, data, length, nostop, busTimeout(length));
+    return busDone(&eeprom_bus.stats.write, result, started_us, true);
+}
+
+static int busRead(uint8_t *data, size_t length, bool nostop) {
+    uint64_t started_us = time_us_64();
+    int result = i2c_read_timeout_us(i2c0, DEVADDR, data, length, nostop, busTimeout(length));
+    return busDone(&eeprom_bus.stats.read, result, started_us, true);
+}
+
+// One byte read to see whether the device acknowledges its address.
+static bool busPoll() {
+    uint8_t dummy;
+    uint64_t started_us = time_us_64();
+    int result = i2c_read_timeout_us(i2c0, DEVADDR, &dummy, 1, false, busTimeout(1));
+    return 0 <= busDone(&eeprom_bus.stats.poll, result, started_us, false);
+}
+
+// Sets the address and reads length bytes from it, repeating the whole operation if a transfer fails.
+static bool busReadAt(uint16_t address, uint8_t *data, size_t length) {
+    uint8_t buffer[2];
+    buffer[0] = address >> 8; buffer[1] = address;
+    for (int attempt = 0; attempt < I2C_RETRIES; attempt++) {
+        if (0 < attempt) {
+            eeprom_bus.stats.retries++;
+        }
+        if (0 <= busWrite(buffer, 2, true) && 0 <= busRead(data, length, false)) {
+            return true;
+        }
+    }
+    DEBUG_PRINT("EEPROM read at 0x%04x failed.\n", address);
+    return false;
+}
+
+void eepromGetBusStats(eeprom_bus_stats *stats) {
+    *stats = eeprom_bus.stats;
+}
 
 // eeprom function
 void eepromInit() {
-    i2c_init(i2c0, BAUDRATE);
+    i2c_init(i2c0, i2c_baudrates[0]);
     gpio_set_function(I2C_SDA, GPIO_FUNC_I2C);
     gpio_set_function(I2C_SCL, GPIO_FUNC_I2C);
     gpio_pull_up(I2C_SDA);
     gpio_pull_up(I2C_SCL);
+
+    // The device may still be finishing a write from before the reset, so wait for it at the slowest speed, then take
+    // the fastest speed it answers at.
+    busSetSpeed(I2C_BAUDRATES - 1);
+    uint64_t deadline = time_us_64() + I2C_MEM_WRITE_TIME * 1000;
+    while (false == busPoll() && time_us_64() < deadline) {
+    }
+    unsigned speed = 0;
+    do {
+        busSetSpeed(speed);
+    } while (false == busPoll() && ++speed < I2C_BAUDRATES);
+    DEBUG_PRINT("EEPROM at %u Hz.\n", (unsigned) eeprom_bus.stats.baudrate);
+}
+
+_Static_assert(sizeof(DeviceState) <= STATE_SLOT_SIZE, "DeviceState does not fit into a journal slot");
+
+static uint32_t state_generation;       // generation of the newest stored state, 0 if there is none
+static DeviceState journal[STATE_SLOTS]; // what each slot holds, read on boot and kept up to date by every write
+static uint32_t journal_unknown;        // slots whose last write failed, so what they hold is not known
+static bool journal_loaded = false;
+
+_Static_assert(STATE_SLOTS <= 32, "journal_unknown keeps one bit per slot in an uint32_t");
+
+static uint16_t stateSlot(uint32_t generation) {
+    return (generation / STATE_PAIR_GENERATIONS) % (STATE_SLOTS / 2) * 2 + generation % 2;
+}
+
+// CRC of the struct with the crc16 field taken as zero.
+static uint16_t stateCrc(const DeviceState *state) {
+    static const uint8_t cleared[sizeof(state->crc16)];
+    const uint8_t *bytes = (const uint8_t *) state;
+    const size_t after_crc = offsetof(DeviceState, crc16) + sizeof(state->crc16);
+
+    uint16_t crc = crc16_init();
+    crc = crc16_update(crc, bytes, offsetof(DeviceState, crc16));
+    crc = crc16_update(crc, cleared, sizeof(cleared));
+    crc = crc16_update(crc, bytes + after_crc, sizeof(DeviceState) - after_crc);
+    return crc16_final(crc);
 }
 
-void write_to_eeprom(const DeviceState *state) {
+// Reads all journal slots and finds the valid state with the highest generation. Returns its slot or -1.
+static int journalLoad() {
+    int newest = -1;
+
+    state_generation = 0;
+    journal_unknown = 0;
+    for (int slot = 0; slot < STATE_SLOTS; slot++) {
+        uint16_t read_address = STATE_JOURNAL_ADDRESS + slot * STATE_SLOT_SIZE;
+        eepromReadBytes(read_address, (uint8_t*) &journal[slot], sizeof(DeviceState));
+
+        if (journal[slot].crc16 == stateCrc(&journal[slot]) && journal[slot].generation > state_generation) {
+            state_generation = journal[slot].generation;
+            newest = slot;
+        }
+    }
+    journal_loaded = true;
+    return newest;
+}
+
+// Writes state to the other slot of the current pair, so the newest stored state stays intact until the new one is
+// complete: a write torn by a power loss fails its CRC on the next boot and the previous state is used. That slot
+// holds the state from two writes ago, so only the bytes up to the last one that differs from it are written,
+// usually the header and a field or two. Nothing is written if the state has not changed since the last write.
+// This is the commit point of the device: it returns once the state and everything written before it, like the log
+// record of the event, are stored in the EEPROM. Returns false if they are not; the newest stored state then stays
+// the one before, and the next write repeats the whole state into the slot.
+bool write_to_eeprom(const DeviceState *state) {
     DeviceState stateToWrite = *state;
 
-    uint16_t crc = crc16((uint8_t *) &stateToWrite, sizeof(stateToWrite)-sizeof(stateToWrite.crc16));
-    stateToWrite.crc16 = crc;
+    if (false == journal_loaded) {
+        journalLoad();
+    }
+    if (0 != state_generation) {
+        const DeviceState *newest = &journal[stateSlot(state_generation)];
+        stateToWrite.generation = newest->generation;
+        stateToWrite.crc16 = newest->crc16;
+        if (0 == memcmp(&stateToWrite, newest, sizeof(stateToWrite))) {
+            return eepromSync();
+        }
+    }
+    stateToWrite.generation = state_generation + 1;
+    stateToWrite.crc16 = stateCrc(&stateToWrite);
 
-    uint16_t write_address = I2C_MEMORY_SIZE - sizeof(stateToWrite);
-    uint8_t *buffer = (uint8_t *) &stateToWrite;
-    eepromWriteBytes(write_address, buffer, sizeof(stateToWrite));
+    uint16_t slot = stateSlot(stateToWrite.generation);
+    const uint8_t *stored = (const uint8_t *) &journal[slot];
+    const uint8_t *buffer = (const uint8_t *) &stateToWrite;
+    int length = sizeof(stateToWrite);
+    while (0 == (journal_unknown >> slot & 1) && length > 0 && stored[length - 1] == buffer[length - 1]) {
+        length--;
+    }
+    eepromWriteBytes(STATE_JOURNAL_ADDRESS + slot * STATE_SLOT_SIZE, buffer, length);
+    if (false == eepromSync()) {
+        DEBUG_PRINT("State #%u not stored.\n", (unsigned) stateToWrite.generation);
+        journal_unknown |= (uint32_t) 1 << slot;
+        return false;
+    }
+    journal[slot] = stateToWrite;
+    journal_unknown &= ~((uint32_t) 1 << slot);
+    state_generation = stateToWrite.generation;
+    return true;
 }
 
 bool read_from_eeprom(DeviceState *state) {
-    DeviceState stateToRead;
-    uint16_t read_address = I2C_MEMORY_SIZE - sizeof(stateToRead);
-    eepromReadBytes(read_address, (uint8_t*) &stateToRead, sizeof(stateToRead));
-    uint16_t calc_crc16 = crc16((uint8_t*)&stateToRead,sizeof(stateToRead) -sizeof(stateToRead.crc16));
+    int newest = journalLoad();
+    if (0 > newest) {
+        return false;
+    }
+    memcpy(state, &journal[newest], sizeof(DeviceState));
+    return true;
+}
 
-    if (stateToRead.crc16 == calc_crc16) {
-        memcpy(state, &stateToRead, sizeof(stateToRead));
+
+// Completion of the EEPROM's internal write cycle. During the cycle the device does not acknowledge its address, so
+// polling it for an ACK tells when the write is done instead of always sleeping for the worst case.
+static struct {
+    bool busy;                  // a write cycle may still be running
+    uint64_t started_us;
+    eeprom_write_stats stats;
+} eeprom_write;
+
+// Polls the device once. Returns true if no write cycle is running anymore.
+static bool eepromPoll() {
+    if (false == eeprom_write.busy) {
         return true;
-    } else {
+    }
+    if (false == busPoll()) {
+        eeprom_write.stats.polls++;
         return false;
     }
+    uint32_t latency = (uint32_t) (time_us_64() - eeprom_write.started_us);
+    eeprom_write.busy = false;
+    eeprom_write.stats.total_us += latency;
+    if (latency > eeprom_write.stats.max_us) {
+        eeprom_write.stats.max_us = latency;
+    }
+    return true;
+}
+
+// Waits for the running write cycle, giving up after I2C_MEM_WRITE_TIME ms.
+static bool eepromWaitCycle() {
+    uint64_t deadline = eeprom_write.started_us + I2C_MEM_WRITE_TIME * 1000;
+    while (false == eepromPoll()) {
+        if (time_us_64() >= deadline) {
+            eeprom_write.busy = false;
+            eeprom_write.stats.timeouts++;
+            DEBUG_PRINT("EEPROM write cycle timed out.\n");
+            return false;
+        }
+    }
+    return true;
+}
+
+// Sends a write transfer (address and data) and starts timing its write cycle. A failed transfer is sent again once
+// the device answers, as it may have taken the bytes anyway and be busy programming them. Returns false if the device
+// never acknowledged the write.
+static bool eepromStartWrite(const uint8_t *buffer, size_t length) {
+    for (int attempt = 0; attempt < I2C_RETRIES; attempt++) {
+        if (0 < attempt) {
+            eeprom_bus.stats.retries++;
+            uint64_t deadline = time_us_64() + I2C_MEM_WRITE_TIME * 1000;
+            while (false == busPoll() && time_us_64() < deadline) {
+            }
+        }
+        if (0 <= busWrite(buffer, length, false)) {
+            eeprom_write.busy = true;
+            eeprom_write.started_us = time_us_64();
+            eeprom_write.stats.writes++;
+            return true;
+        }
+    }
+    DEBUG_PRINT("EEPROM did not acknowledge write.\n");
+    return false;
+}
+
+void eepromGetWriteStats(eeprom_write_stats *stats) {
+    *stats = eeprom_write.stats;
+}
+
+
+// Write-back cache of EEPROM pages. A write only changes the cached page and marks the bytes that differ from what
+// the EEPROM holds as dirty, so further writes to the same page before it is programmed cost no extra write cycle.
+// A dirty page is programmed from its first to its last dirty byte when it has to make room for another page, when it
+// has been dirty for EEPROM_WRITE_BACK_MS and the device is idle, or by eepromFlush() and eepromSync(). Reads of
+// cached bytes do not touch the bus.
+#define EEPROM_CACHE_PAGES 4
+#define EEPROM_WRITE_BACK_MS 40
+
+_Static_assert(I2C_MEM_PAGE_SIZE <= 64, "the cache keeps one bit per byte of a page in an uint64_t");
+
+typedef struct cache_page {
+    bool used;
+    uint16_t address;           // of the first byte of the page
+    uint64_t known;             // bytes that hold what is in the EEPROM or a newer write
+    uint64_t dirty;             // bytes written since the page was last programmed
+    uint64_t dirty_since_us;
+    uint32_t last_used;
+    uint8_t data[I2C_MEM_PAGE_SIZE];
+} cache_page;
+
+static struct {
+    cache_page pages[EEPROM_CACHE_PAGES];
+    uint32_t clock;             // ticks on every access, for the least recently used eviction
+    bool failed;                // a dirty page was lost since the last eepromSync()
+    eeprom_cache_stats stats;
+} eeprom_cache;
+
+static uint64_t byteMask(unsigned offset, unsigned length) {
+    return (64 == length ? ~(uint64_t) 0 : ((uint64_t) 1 << length) - 1) << offset;
+}
+
+static cache_page *cacheFind(uint16_t address) {
+    uint16_t page_address = address - address % I2C_MEM_PAGE_SIZE;
+    for (int i = 0; i < EEPROM_CACHE_PAGES; i++) {
+        cache_page *page = &eeprom_cache.pages[i];
+        if (true == page->used && page_address == page->address) {
+            page->last_used = ++eeprom_cache.clock;
+            return page;
+        }
+    }
+    return NULL;
+}
+
+// Starts the write cycles of a dirty page, usually one from its first to its last dirty byte. Gaps between the dirty
+// bytes that have never been read are read first, as the write has to repeat what is stored there; if that read
+// fails, each run of dirty bytes between the unknown ones gets a write of its own. Returns false, with the bytes not
+// sent still dirty, if the device did not acknowledge a write.
+static bool cacheProgram(cache_page *page) {
+    unsigned first = 0;
+    unsigned last = I2C_MEM_PAGE_SIZE - 1;
+    while (0 == (page->dirty >> first & 1)) {
+        first++;
+    }
+    while (0 == (page->dirty >> last & 1)) {
+        last--;
+    }
+    unsigned length = last - first + 1;
+    uint64_t span = byteMask(first, length);
+
+    uint8_t buffer[I2C_MEM_PAGE_SIZE + 2];
+    eepromWaitCycle();
+    if (span != (page->known & span) && true == busReadAt(page->address + first, &buffer[2], length)) {
+        for (unsigned i = first; i <= last; i++) {
+            if (0 == (page->known >> i & 1)) {
+                page->data[i] = buffer[2 + i - first];
+            }
+        }
+        page->known |= span;
+    }
+
+    while (0 != page->dirty) {
+        first = 0;
+        while (0 == (page->dirty >> first & 1)) {
+            first++;
+        }
+        /* the write ends with the last dirty byte before the first byte that is not known */
+        last = first;
+        for (unsigned i = first + 1; i < I2C_MEM_PAGE_SIZE && 0 != (page->known >> i & 1); i++) {
+            if (0 != (page->dirty >> i & 1)) {
+                last = i;
+            }
+        }
+        length = last - first + 1;
+        buffer[0] = (page->address + first) >> 8; buffer[1] = page->address + first;
+        memcpy(&buffer[2], &page->data[first], length);
+        eepromWaitCycle();
+        if (false == eepromStartWrite(buffer, length + 2)) {
+            return false;
+        }
+        page->dirty &= ~byteMask(first, length);
+        eeprom_cache.stats.programs++;
+    }
+    return true;
 }
 
+// The page that has been dirty for the longest time, or NULL.
+static cache_page *cacheOldestDirty() {
+    cache_page *oldest = NULL;
+    for (int i = 0; i < EEPROM_CACHE_PAGES; i++) {
+        cache_page *page = &eeprom_cache.pages[i];
+        if (0 != page->dirty && (NULL == oldest || page->dirty_since_us < oldest->dirty_since_us)) {
+            oldest = page;
+        }
+    }
+    return oldest;
+}
+
+// Programs the oldest dirty page if it is due and the device is not busy. Called on every access, so the cache never
+// holds back a write for much longer than EEPROM_WRITE_BACK_MS while the EEPROM is in use.
+static void cacheWriteBack() {
+    cache_page *page = cacheOldestDirty();
+    if (NULL != page && time_us_64() - page->dirty_since_us >= EEPROM_WRITE_BACK_MS * 1000 && true == eepromPoll()) {
+        cacheProgram(page);
+    }
+}
 
+// Returns the cached page holding address, taking a free or the least recently used one if there is none.
+static cache_page *cacheGet(uint16_t address) {
+    cache_page *page = cacheFind(address);
+    if (NULL != page) {
+        return page;
+    }
+    page = &eeprom_cache.pages[0];
+    for (int i = 1; i < EEPROM_CACHE_PAGES && true == page->used; i++) {
+        if (false == eeprom_cache.pages[i].used || eeprom_cache.pages[i].last_used < page->last_used) {
+            page = &eeprom_cache.pages[i];
+        }
+    }
+    if (0 != page->dirty) {
+        eeprom_cache.stats.evictions++;
+        if (false == cacheProgram(page)) {
+            /* the page has to make room anyway */
+            eeprom_cache.stats.lost++;
+            eeprom_cache.failed = true;
+            page->dirty = 0;
+        }
+    }
+    page->used = true;
+    page->address = address - address % I2C_MEM_PAGE_SIZE;
+    page->known = 0;
+    page->last_used = ++eeprom_cache.clock;
+    return page;
+}
+
+// Programs the dirty pages holding bytes between address and address + length. Returns false if the device did not
+// take one of them.
+static bool cacheFlushRange(uint16_t address, uint16_t length) {
+    for (int i = 0; i < EEPROM_CACHE_PAGES; i++) {
+        cache_page *page = &eeprom_cache.pages[i];
+        if (0 != page->dirty && page->address + I2C_MEM_PAGE_SIZE > address && page->address < address + length &&
+            false == cacheProgram(page)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void eepromGetCacheStats(eeprom_cache_stats *stats) {
+    *stats = eeprom_cache.stats;
+}
+
+// Starts programming all dirty pages, oldest first, and returns with the last write cycle still running. Stops at a
+// write the device does not acknowledge, leaving that page and the newer ones dirty.
+void eepromFlush() {
+    cache_page *page;
+    while (NULL != (page = cacheOldestDirty()) && true == cacheProgram(page)) {
+    }
+}
+
+// The barrier for crash-critical points: returns once everything written so far is stored in the EEPROM. Returns
+// false if the device did not take a write, a page was lost since the last call or a write cycle did not finish in
+// time.
+bool eepromSync() {
+    eepromFlush();
+    bool stored = true == eepromWaitCycle() && NULL == cacheOldestDirty() && false == eeprom_cache.failed;
+    eeprom_cache.failed = false;
+    return stored;
+}
+
+// Writes into the page cache; see eepromSync() for when the bytes have to be in the EEPROM.
 void eepromWriteBytes(uint16_t address, const uint8_t *data, uint8_t length) {
     assert(data != NULL);
     assert(address < I2C_MEMORY_SIZE);
@@ -62,30 +521,89 @@ void eepromWriteBytes(uint16_t address, const uint8_t *data, uint8_t length) {
     assert(length <= I2C_MEM_PAGE_SIZE);
     assert((address / I2C_MEM_PAGE_SIZE) == ((address + length - 1) / I2C_MEM_PAGE_SIZE));
 
-    uint8_t buffer[length+2];
-    buffer[0] = address >> 8; buffer[1] = address;
-    memcpy( &buffer[2], data, length);
-    i2c_write_blocking(i2c0, DEVADDR, buffer, sizeof(buffer), false);
-    sleep_ms(I2C_MEM_WRITE_TIME);
+    cacheWriteBack();
+    cache_page *page = cacheGet(address);
+    unsigned offset = address % I2C_MEM_PAGE_SIZE;
+    uint64_t changed = 0;
+    for (unsigned i = 0; i < length; i++) {
+        if (0 == (page->known >> (offset + i) & 1) || data[i] != page->data[offset + i]) {
+            changed |= (uint64_t) 1 << (offset + i);
+        }
+    }
+    memcpy(&page->data[offset], data, length);
+    page->known |= byteMask(offset, length);
+
+    eeprom_cache.stats.writes++;
+    if (0 == changed) {
+        return;
+    }
+    if (0 == page->dirty) {
+        page->dirty_since_us = time_us_64();
+    } else {
+        eeprom_cache.stats.coalesced++;
+    }
+    page->dirty |= changed;
 }
 
 
+// Does not wait for the write cycle: the byte stays in the page cache, newer bytes for the same page join it, and it
+// reaches the EEPROM about EEPROM_WRITE_BACK_MS later or at the next eepromSync().
 void eepromWriteByte_NoDelay(uint16_t address, uint8_t data) {
     assert(address < I2C_MEMORY_SIZE);
 
-    uint8_t buffer[3];
-    buffer[0] = address >> 8; buffer[1] = address; buffer[2] = data;
-    i2c_write_blocking(i2c0, DEVADDR, buffer, sizeof(buffer), false);
+    eepromWriteBytes(address, &data, 1);
+}
+
+
+// Fills length bytes from address with value, a whole page per write. Each page is sent as soon as the previous write
+// cycle has ended and the last cycle is left running, so filling n pages takes about n write cycles. Cached bytes in
+// the range take the value too and are no longer dirty. Returns false if the device did not take a page; the fill
+// stops there and the cached bytes of the range are read from the device again.
+bool eepromFill(uint16_t address, uint8_t value, uint16_t length) {
+    assert(address + length <= I2C_MEMORY_SIZE);
+
+    uint8_t buffer[I2C_MEM_PAGE_SIZE + 2];
+    bool stored = true;
+    memset(&buffer[2], value, I2C_MEM_PAGE_SIZE);
+    for (uint16_t at = address, left = length; 0 < left && true == stored; ) {
+        uint16_t chunk = I2C_MEM_PAGE_SIZE - at % I2C_MEM_PAGE_SIZE;
+        if (chunk > left) {
+            chunk = left;
+        }
+        buffer[0] = at >> 8; buffer[1] = at;
+        eepromWaitCycle();
+        stored = eepromStartWrite(buffer, chunk + 2);
+        at += chunk;
+        left -= chunk;
+    }
+
+    for (int i = 0; i < EEPROM_CACHE_PAGES; i++) {
+        cache_page *page = &eeprom_cache.pages[i];
+        if (true == page->used && page->address + I2C_MEM_PAGE_SIZE > address && page->address < address + length) {
+            unsigned first = page->address < address ? address - page->address : 0;
+            unsigned end = address + length - page->address;
+            if (end > I2C_MEM_PAGE_SIZE) {
+                end = I2C_MEM_PAGE_SIZE;
+            }
+            uint64_t filled = byteMask(first, end - first);
+            memset(&page->data[first], value, end - first);
+            if (true == stored) {
+                page->known |= filled;
+            } else {
+                page->known &= ~filled;
+            }
+            page->dirty &= ~filled;
+        }
+    }
+    return stored;
 }
 
 
 void eepromWriteByte(uint16_t address, uint8_t data) {
     assert(address < I2C_MEMORY_SIZE);
 
-    uint8_t buffer[3];
-    buffer[0] = address >> 8; buffer[1] = address; buffer[2] = data;
-    i2c_write_blocking(i2c0, DEVADDR, buffer, sizeof(buffer), false);
-    sleep_ms(I2C_MEM_WRITE_TIME);
+    eepromWriteBytes(address, &data, 1);
+    eepromSync();
 }
 
 
@@ -93,131 +611,432 @@ void eepromWriteByte(uint16_t address, uint8_t data) {
 uint8_t eepromReadByte(uint16_t address) {
     assert(address < I2C_MEMORY_SIZE);
 
-    uint8_t buffer[2];
-    buffer[0] = address >> 8; buffer[1] = address;
-    i2c_write_blocking(i2c0, DEVADDR, buffer, 2, true);
-    i2c_read_blocking(i2c0, DEVADDR, buffer, 1, false);
-    return buffer[0];
+    uint8_t data = 0xFF;
+    eepromReadBytes(address, &data, 1);
+    return data;
 }
 
+// Serves the bytes of cached pages from RAM and reads the rest page by page; bytes read for a cached page are kept.
 void eepromReadBytes(uint16_t address, uint8_t *data, uint8_t length) {
     assert(data != NULL);
     assert(address < I2C_MEMORY_SIZE);
     assert(0 < length);
 
-    uint8_t buffer[2];
-    buffer[0] = address >> 8; buffer[1] = address;
-    i2c_write_blocking(i2c0, DEVADDR, buffer, 2, true);
-    i2c_read_blocking(i2c0, DEVADDR, data, length, false);
+    cacheWriteBack();
+    while (0 < length) {
+        unsigned offset = address % I2C_MEM_PAGE_SIZE;
+        unsigned chunk = I2C_MEM_PAGE_SIZE - offset;
+        if (chunk > length) {
+            chunk = length;
+        }
+        uint64_t wanted = byteMask(offset, chunk);
+        cache_page *page = cacheFind(address);
+
+        if (NULL != page && wanted == (page->known & wanted)) {
+            memcpy(data, &page->data[offset], chunk);
+            eeprom_cache.stats.read_hits++;
+        } else {
+            eeprom_cache.stats.read_misses++;
+            eepromWaitCycle();
+            if (true == busReadAt(address, data, chunk) && NULL != page) {
+                for (unsigned i = 0; i < chunk; i++) {
+                    if (0 != (page->known >> (offset + i) & 1)) {
+                        data[i] = page->data[offset + i];
+                    } else {
+                        page->data[offset + i] = data[i];
+                    }
+                }
+                page->known |= wanted;
+            }
+        }
+        address += chunk;
+        data += chunk;
+        length -= chunk;
+    }
 }
 
-uint16_t crc16(const uint8_t *data, size_t length) {
-    uint8_t x;
-    uint16_t crc = 0xFFFF;
+// Reads length bytes from address in one transaction and hands them to consume in chunks of READ_CHUNK bytes as they
+// arrive, so the caller can work on them without buffering the whole range. Stops reading as soon as consume returns
+// false. The first chunk is read like any other operation, with retries; a later one that fails ends the stream, as
+// the bytes before it have been consumed already. The stream reads the device, so cached dirty pages in the range are
+// programmed first.
+void eepromReadStream(uint16_t address, uint16_t length, eeprom_consumer_t consume, void *context) {
+    assert(address + length <= I2C_MEMORY_SIZE);
 
-    while (length--) {
-        x = crc >> 8 ^ *data++;
-        x ^= x >> 4;
-        crc = (crc << 8) ^ ((uint16_t) (x << 12)) ^ ((uint16_t) (x << 5)) ^ ((uint16_t) (x));
+    uint8_t chunk[READ_CHUNK];
+    uint16_t size = length < READ_CHUNK ? length : READ_CHUNK;
+    cacheFlushRange(address, length);
+    eepromWaitCycle();
+    if (0 == length || false == busReadAt(address, chunk, size)) {
+        return;
+    }
+    /* the first chunk ends with a STOP, the rest are current address reads in one transaction */
+    bool claimed = false;
+    while (true == consume(chunk, size, context)) {
+        length -= size;
+        if (0 == length) {
+            return;
+        }
+        size = length < READ_CHUNK ? length : READ_CHUNK;
+        /* the bus stays claimed between chunks, the device keeps counting its address up */
+        claimed = size < length;
+        if (0 > busRead(chunk, size, claimed)) {
+            return;
+        }
+    }
+    if (true == claimed) {
+        /* end the transaction with a STOP after one more byte */
+        busRead(chunk, 1, false);
     }
-    return crc;
 }
 
 
-void writeLogEntry(const char *message) {
-    if (*log_counter >= MAX_LOG_ENTRY) {
-        DEBUG_PRINT("Maximum allowed log number reached. ");
-        eraseLog();
-    }
+// Journal of the stepper position during a turn. Every record goes to the slot after the previous one with a sequence
+// number and a CRC: a record torn by a power loss leaves the one before it readable, and the writes spread over the
+// page instead of wearing out one byte.
+typedef struct position_record {
+    uint16_t sequence;
+    int16_t steps;
+    uint16_t crc16;
+} position_record;
 
-    size_t message_length = strlen(message);
-    if (message_length >= 1) {
-        if (message_length > 61) {
-            message_length = 61;
+_Static_assert(sizeof(position_record) <= POSITION_SLOT_SIZE, "a position record does not fit into its slot");
+
+static struct {
+    bool loaded;
+    uint16_t sequence;          // of the newest record
+    int steps;                  // of the newest record
+} position_journal;
+
+static uint16_t positionCrc(const position_record *record) {
+    return crc16((const uint8_t *) record, offsetof(position_record, crc16));
+}
+
+static void positionLoad() {
+    uint8_t page[I2C_MEM_PAGE_SIZE];
+    bool found = false;
+
+    eepromReadBytes(STEPPER_POSITION_ADDRESS, page, sizeof(page));
+    position_journal.sequence = 0;
+    position_journal.steps = 0;
+    for (int slot = 0; slot < POSITION_SLOTS; slot++) {
+        position_record record;
+        memcpy(&record, &page[slot * POSITION_SLOT_SIZE], sizeof(record));
+        /* sequence numbers wrap, the newest one is ahead of all others by less than half their range */
+        if (record.crc16 == positionCrc(&record) &&
+            (false == found || 0 < (int16_t) (record.sequence - position_journal.sequence))) {
+            position_journal.sequence = record.sequence;
+            position_journal.steps = record.steps;
+            found = true;
         }
+    }
+    position_journal.loaded = true;
+}
 
-        uint8_t buffer[message_length + 3];
-        memcpy(buffer, message, message_length);
-        buffer[message_length] = '\0';
+// Writes the next record into the cache and programs it right away if flush is set. Returns false, without moving on
+// to the next slot, if the device did not take it.
+static bool positionAppend(int steps, bool flush) {
+    position_record record = {.sequence = position_journal.sequence + 1, .steps = (int16_t) steps};
+    record.crc16 = positionCrc(&record);
+    eepromWriteBytes(STEPPER_POSITION_ADDRESS + record.sequence % POSITION_SLOTS * POSITION_SLOT_SIZE,
+                     (const uint8_t *) &record, sizeof(record));
+    if (true == flush && false == cacheFlushRange(STEPPER_POSITION_ADDRESS, I2C_MEM_PAGE_SIZE)) {
+        return false;
+    }
+    position_journal.sequence = record.sequence;
+    position_journal.steps = steps;
+    return true;
+}
 
-        uint16_t crc = crc16(buffer, message_length + 1);
-        buffer[message_length + 1] = (uint8_t) (crc >> 8);
-        buffer[message_length + 2] = (uint8_t) crc;
+// Journals the steps the wheel has turned into the current turn, for positionRead() after a power loss. Called as
+// often as the caller likes while the wheel turns, it never waits: a record is only due once the wheel is
+// POSITION_JOURNAL_STEPS past the last one, and is sent only when the EEPROM is idle, straight past the write-back
+// delay of the cache. As nothing else writes during a turn, the stored position lags the wheel by less than
+// POSITION_JOURNAL_STEPS plus the steps of two write cycles, one of them torn. An exact record is always taken, for the
+// start and the end of a turn, and is stored by the next eepromSync(). Returns false if the device did not take a
+// record that was sent; the next call tries again.
+bool positionWrite(int steps, bool exact) {
+    if (false == position_journal.loaded) {
+        positionLoad();
+    }
+    if (steps == position_journal.steps) {
+        return true;
+    }
+    if (true == exact) {
+        return positionAppend(steps, false);
+    }
+    if (abs(steps - position_journal.steps) >= POSITION_JOURNAL_STEPS && true == eepromPoll()) {
+        return positionAppend(steps, true);
+    }
+    return true;
+}
 
-        uint16_t log_address = MAX_LOG_SIZE * *log_counter;
-        *log_counter = *log_counter + 1;
-        eepromWriteBytes(log_address, buffer, message_length+3);
-    } else {
-        DEBUG_PRINT("Invalid input. Log message must contain at least one character.\n");
+// The steps of the newest position record, 0 if there is none.
+int positionRead() {
+    if (false == position_journal.loaded) {
+        positionLoad();
     }
+    return position_journal.steps;
 }
 
 
-void printLog() {
-    if (0 != *log_counter) {
-        uint16_t log_address = MEM_ADDR_START;
-        uint8_t buffer[MAX_LOG_SIZE];
+// The log is a circular array of MAX_LOG_ENTRY records, one per MAX_LOG_SIZE slot:
+//
+//   sequence number (4 bytes, big endian) | message | '\0' | crc16 (2 bytes, big endian)
+//
+// Records are appended at the head and the oldest record is overwritten once the log is full, so every slot is
+// written equally often. Sequence numbers count all records ever written; a slot whose CRC does not match is empty.
+#define LOG_HEADER_SIZE 4
+#define LOG_MAX_MESSAGE (MAX_LOG_SIZE - LOG_HEADER_SIZE - 3)
 
-        DEBUG_PRINT("Printing log messages from memory:\n");
-        for (int i = 0; i < *log_counter; i++) {
-            log_address = i * MAX_LOG_SIZE;
-            eepromReadBytes(log_address, buffer, MAX_LOG_SIZE);
+static uint16_t log_head;               // slot of the next record
+static uint32_t log_next_sequence;
 
-            int term_zero_index = 0;
-            while (buffer[term_zero_index] != '\0') {
-                term_zero_index++;
-            }
+// Parses a log record chunk by chunk as it is read from the EEPROM.
+typedef struct log_reader {
+    uint16_t crc;
+    uint8_t position;           // record bytes seen so far
+    uint8_t message_length;
+    bool terminated;            // the message's '\0' has been seen
+    bool valid;
+    uint32_t sequence;
+    char *message;              // receives the message unless NULL, LOG_MAX_MESSAGE + 1 bytes
+} log_reader;
 
-            if(0 == crc16(buffer, (term_zero_index + 3)) && buffer[0] != 0 && (term_zero_index < (MAX_LOG_SIZE - 2))) {
-                DEBUG_PRINT("Log #%d: ", i + 1);
-                int index = 0;
-                while (buffer[index]) {
-                    DEBUG_PRINT("%c", buffer[index++]);
+static bool logReaderConsume(const uint8_t *chunk, size_t length, void *context) {
+    log_reader *reader = context;
+    size_t used = 0;
+    bool complete = false;
+
+    while (used < length && false == complete) {
+        uint8_t byte = chunk[used++];
+        if (reader->position < LOG_HEADER_SIZE) {
+            reader->sequence = reader->sequence << 8 | byte;
+        } else if (false == reader->terminated) {
+            if ('\0' == byte) {
+                if (0 == reader->message_length) {
+                    return false;
                 }
-                DEBUG_PRINT("\n");
-            } else {
-                DEBUG_PRINT("Log message #%d invalid. Exit printing.\n", i + 1);
-                break;
+                reader->terminated = true;
+            } else if (LOG_MAX_MESSAGE == reader->message_length) {
+                return false;
+            } else if (NULL != reader->message) {
+                reader->message[reader->message_length] = (char) byte;
+            }
+            if (false == reader->terminated) {
+                reader->message_length++;
             }
+        } else {
+            /* the CRC itself: the CRC over the record including it is 0 */
+            complete = LOG_HEADER_SIZE + reader->message_length + 3 == reader->position + 1;
         }
+        reader->position++;
+    }
+    reader->crc = crc16_update(reader->crc, chunk, used);
+    if (true == complete) {
+        reader->valid = 0 == crc16_final(reader->crc);
+        if (true == reader->valid && NULL != reader->message) {
+            reader->message[reader->message_length] = '\0';
+        }
+    }
+    return false == complete;
+}
+
+// Reads the record in slot, only as far as it goes, and copies its message to message unless that is NULL. Returns
+// false if the slot holds no valid record.
+static bool logReadRecord(uint16_t slot, char *message, uint32_t *sequence) {
+    log_reader reader = {.crc = crc16_init(), .message = message};
+
+    eepromReadStream(MEM_ADDR_START + slot * MAX_LOG_SIZE, MAX_LOG_SIZE, logReaderConsume, &reader);
+    *sequence = reader.sequence;
+    return reader.valid;
+}
+
+// Splits a bulk read of the log region into slots and runs a log_reader over each of them.
+typedef struct log_scan {
+    log_reader reader;
+    bool reading;               // the record in the current slot has not been completed or rejected yet
+    uint8_t offset;             // position inside the current slot
+    char message[LOG_MAX_MESSAGE + 1];
+    log_record_callback_t callback;
+    void *context;
+    int records;
+} log_scan;
+
+static void logScanStartSlot(log_scan *scan) {
+    scan->reader = (log_reader) {.crc = crc16_init(), .message = scan->message};
+    scan->reading = true;
+    scan->offset = 0;
+}
+
+static bool logScanConsume(const uint8_t *chunk, size_t length, void *context) {
+    log_scan *scan = context;
+
+    while (0 < length) {
+        size_t size = MAX_LOG_SIZE - scan->offset < length ? MAX_LOG_SIZE - scan->offset : length;
+        if (true == scan->reading && false == logReaderConsume(chunk, size, &scan->reader)) {
+            scan->reading = false;
+            if (true == scan->reader.valid) {
+                scan->callback(scan->reader.sequence, scan->message, scan->context);
+                scan->records++;
+            }
+        }
+        chunk += size;
+        length -= size;
+        scan->offset += size;
+        if (MAX_LOG_SIZE == scan->offset) {
+            logScanStartSlot(scan);
+        }
+    }
+    return true;
+}
+
+// Calls callback for every valid record, oldest first, and returns their number. The log region is read in two
+// sequential transactions, from the head to the end and from the start to the head.
+int logForEach(log_record_callback_t callback, void *context) {
+    log_scan scan = {.callback = callback, .context = context};
+
+    logScanStartSlot(&scan);
+    eepromReadStream(MEM_ADDR_START + log_head * MAX_LOG_SIZE, (MAX_LOG_ENTRY - log_head) * MAX_LOG_SIZE,
+                     logScanConsume, &scan);
+    if (0 < log_head) {
+        logScanStartSlot(&scan);
+        eepromReadStream(MEM_ADDR_START, log_head * MAX_LOG_SIZE, logScanConsume, &scan);
+    }
+    return scan.records;
+}
+
+// Finds the head of the log. Slots written since the log last wrapped around carry the sequence number of slot 0
+// plus their index and the slots after them do not, so the head is found by a binary search over the slots.
+void logInit() {
+    uint32_t first;
+    uint32_t sequence;
+
+    if (false == logReadRecord(0, NULL, &first)) {
+        /* empty log, or the record that wrapped around was torn */
+        log_head = 0;
+        log_next_sequence = logReadRecord(MAX_LOG_ENTRY - 1, NULL, &sequence) ? sequence + 1 : 0;
+        return;
+    }
+    uint16_t low = 1;
+    uint16_t high = MAX_LOG_ENTRY;
+    while (low < high) {
+        uint16_t mid = (low + high) / 2;
+        if (logReadRecord(mid, NULL, &sequence) && first + mid == sequence) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    log_head = low % MAX_LOG_ENTRY;
+    log_next_sequence = first + low;
+    DEBUG_PRINT("Log head at slot %d, next record #%u.\n", log_head, log_next_sequence);
+}
+
+
+void writeLogEntry(const char *message) {
+    size_t message_length = strlen(message);
+    if (message_length >= 1) {
+        if (message_length > LOG_MAX_MESSAGE) {
+            message_length = LOG_MAX_MESSAGE;
+        }
+
+        uint8_t buffer[MAX_LOG_SIZE];
+        buffer[0] = (uint8_t) (log_next_sequence >> 24);
+        buffer[1] = (uint8_t) (log_next_sequence >> 16);
+        buffer[2] = (uint8_t) (log_next_sequence >> 8);
+        buffer[3] = (uint8_t) log_next_sequence;
+        memcpy(&buffer[LOG_HEADER_SIZE], message, message_length);
+        buffer[LOG_HEADER_SIZE + message_length] = '\0';
+
+        uint16_t crc = crc16(buffer, LOG_HEADER_SIZE + message_length + 1);
+        buffer[LOG_HEADER_SIZE + message_length + 1] = (uint8_t) (crc >> 8);
+        buffer[LOG_HEADER_SIZE + message_length + 2] = (uint8_t) crc;
+
+        eepromWriteBytes(MEM_ADDR_START + log_head * MAX_LOG_SIZE, buffer, LOG_HEADER_SIZE + message_length + 3);
+        log_head = (log_head + 1) % MAX_LOG_ENTRY;
+        log_next_sequence++;
     } else {
-        DEBUG_PRINT("No log message in memory yet.\n");
+        DEBUG_PRINT("Invalid input. Log message must contain at least one character.\n");
     }
 }
 
 
+static void printRecord(uint32_t sequence, const char *message, void *context) {
+    DEBUG_PRINT("Log #%u: %s\n", sequence + 1, message);
+}
+
+void printLog() {
+    DEBUG_PRINT("Printing log messages from memory:\n");
+    if (0 == logForEach(printRecord, NULL)) {
+        DEBUG_PRINT("No log message in memory yet.\n");
+    }
+}
+
+// Sequence numbers carry on after an erase, so the log's head can still be found. An erase that fails part of the way
+// looks for the head again.
 void eraseLog() {
     DEBUG_PRINT("Erasing log messages from memory:\n");
-    uint16_t log_address = 0;
-    for (int i = 0; i < MAX_LOG_ENTRY; i++) {
-        eepromWriteByte(log_address, 0);
-        log_address += MAX_LOG_SIZE;
+    if (true == eepromFill(MEM_ADDR_START, 0, MAX_LOG_ENTRY * MAX_LOG_SIZE)) {
+        log_head = 0;
+        DEBUG_PRINT("All done.\n");
+    } else {
+        logInit();
     }
-    *log_counter = 0;
-    DEBUG_PRINT("All done.\n");
 }
 
 
 void eraseAll() {
     DEBUG_PRINT("Erasing all messages from memory:\n");
-    uint16_t log_address = 0;
-    for (int i = 0; i < MAX_LOG_ENTRY*MAX_LOG_SIZE; i++) {
-        eepromWriteByte(log_address, 0xFF);
-        log_address ++;
+    if (true == eepromFill(MEM_ADDR_START, 0xFF, MAX_LOG_ENTRY * MAX_LOG_SIZE)) {
+        log_head = 0;
+        DEBUG_PRINT("All done.\n");
+    } else {
+        logInit();
+    }
+}
+
+
+// Returns the EEPROM to its factory-fresh state: no log, no stored stepper position and no valid DeviceState. Returns
+// false if the device did not take all of it; what is left is then read from it again.
+bool factoryReset() {
+    DEBUG_PRINT("Factory reset:\n");
+    position_journal.loaded = false;
+    if (false == eepromFill(MEM_ADDR_START, 0xFF, MAX_LOG_ENTRY * MAX_LOG_SIZE) ||
+        false == eepromFill(STEPPER_POSITION_ADDRESS, 0xFF, I2C_MEM_PAGE_SIZE) ||
+        false == eepromFill(STATE_JOURNAL_ADDRESS, 0xFF, STATE_SLOTS * STATE_SLOT_SIZE) ||
+        false == eepromSync()) {
+        journal_loaded = false;
+        logInit();
+        return false;
     }
+    memset(journal, 0xFF, sizeof(journal));
+    journal_unknown = 0;
+    journal_loaded = true;
+    state_generation = 0;
+    log_head = 0;
+    log_next_sequence = 0;
     DEBUG_PRINT("All done.\n");
+    return true;
 }
 
 
 
-void printAllMemory() {
-    DEBUG_PRINT("Printing all messages from memory:\n");
-    for (int i = 0; i < MAX_LOG_ENTRY; i++) {
-        for (int j = 0; j<MAX_LOG_ENTRY; j ++) {
-            uint8_t printed = eepromReadByte(i * MAX_LOG_SIZE + j);
-            DEBUG_PRINT("%x", printed);
+static bool printBytes(const uint8_t *chunk, size_t length, void *context) {
+    int *printed = context;
+    for (size_t i = 0; i < length; i++) {
+        DEBUG_PRINT("%02x", chunk[i]);
+        if (0 == ++*printed % MAX_LOG_SIZE) {
+            DEBUG_PRINT("\n");
         }
-        DEBUG_PRINT("\n");
     }
-    DEBUG_PRINT("\n");
+    return true;
 }
+
+// Dumps the log region in hex, one slot per line, read in a single transaction.
+void printAllMemory() {
+    int printed = 0;
+    DEBUG_PRINT("Printing all messages from memory:\n");
+    eepromReadStream(MEM_ADDR_START, MAX_LOG_ENTRY * MAX_LOG_SIZE, printBytes, &printed);
+    DEBUG_PRINT("\n");
+}
\ No newline at end of file
@@ -4,15 +4,31 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include<stdio.h>
+#include "crc16.h"
 
 /*   I2C   */
 #define I2C_MEM_PAGE_SIZE 64
-#define I2C_MEM_WRITE_TIME 10
+#define I2C_MEM_WRITE_TIME 10      // upper bound of a write cycle in ms; writes end earlier by ACK polling
 #define MEM_ADDR_START 0
-#define MAX_LOG_SIZE 64
+#define MAX_LOG_SIZE 64             // one log record slot, a whole EEPROM page
 #define MAX_LOG_ENTRY 32
+#define I2C_MEMORY_SIZE 32768
 #define STEPPER_POSITION_ADDRESS  ( I2C_MEMORY_SIZE / 2 )
 
+/*   DeviceState journal: a ring of slots at the end of the memory, written in pairs that move on every
+ *   STATE_PAIR_GENERATIONS writes   */
+#define STATE_SLOTS 16
+#define STATE_PAIR_GENERATIONS 64
+#define STATE_SLOT_SIZE I2C_MEM_PAGE_SIZE
+#define STATE_JOURNAL_ADDRESS ( I2C_MEMORY_SIZE - STATE_SLOTS * STATE_SLOT_SIZE )
+
+/*   Stepper position journal: records of the steps into the current turn, in rotating slots of one page   */
+#define POSITION_SLOTS 8
+#define POSITION_SLOT_SIZE ( I2C_MEM_PAGE_SIZE / POSITION_SLOTS )
+#ifndef POSITION_JOURNAL_STEPS
+#define POSITION_JOURNAL_STEPS 8   // steps the wheel moves on before the next record is due
+#endif
+
 
 enum SystemState {
     CALIB_WAITING,       // EEPROM, CALIBRATED: 0 == CALIB_WAITING
@@ -24,30 +40,86 @@ enum CompartmentState {
     FINISHED            //         1 == FINISHED
 };
 
+// write_to_eeprom() only writes the bytes from the start of the struct to the last changed one, so the header and
+// the fields that change on every compartment come first.
 typedef struct DeviceState {
-    enum SystemState current_state;
+    uint32_t generation;        // set by write_to_eeprom(), the newest valid slot wins on boot
+    uint16_t crc16;             // of the whole struct with this field cleared
     enum CompartmentState compartmentFinished;
-    int logCounter;
+    int compartmentsMoved;
+    uint32_t uplinkSequence;    // of the last uplink, its low 16 bits are sent in the payload
+    enum SystemState currentState;
+    int calibrationCount;
     int portion_count;
     bool motor_calibrated;
-    int calibrationCount;
-    int compartmentsMoved;
-    uint16_t crc16;
 } DeviceState;
 
+typedef struct eeprom_write_stats {
+    uint32_t writes;
+    uint32_t polls;             // ACK polls that found the device still busy
+    uint32_t timeouts;          // write cycles that did not finish within I2C_MEM_WRITE_TIME
+    uint32_t total_us;          // sum of the write cycle latencies
+    uint32_t max_us;
+} eeprom_write_stats;
+
+typedef struct eeprom_cache_stats {
+    uint32_t writes;            // eepromWriteBytes() calls
+    uint32_t coalesced;         // writes to a page that was waiting to be programmed already
+    uint32_t programs;          // write cycles started for dirty pages
+    uint32_t evictions;         // dirty pages programmed to make room for another page
+    uint32_t lost;              // dirty pages dropped for another page as the device did not take their write
+    uint32_t read_hits;         // pages read from RAM
+    uint32_t read_misses;
+} eeprom_cache_stats;
+
+typedef struct eeprom_op_stats {
+    uint32_t count;             // transfers
+    uint32_t errors;            // NACKed transfers; a busy device NACKing an ACK poll is no error
+    uint32_t timeouts;
+    uint32_t total_us;          // sum of the transfer latencies
+    uint32_t max_us;
+} eeprom_op_stats;
+
+typedef struct eeprom_bus_stats {
+    uint32_t baudrate;          // current bus speed
+    eeprom_op_stats write;
+    eeprom_op_stats read;
+    eeprom_op_stats poll;
+    uint32_t retries;           // operations repeated after a failed transfer
+    uint32_t recoveries;        // stuck buses freed by clocking SCL
+    uint32_t fallbacks;         // switches to a slower speed
+} eeprom_bus_stats;
+
+// Receives the bytes of eepromReadStream() chunk by chunk; returns false to stop the read.
+typedef bool (*eeprom_consumer_t)(const uint8_t *chunk, size_t length, void *context);
+
+// Receives the records of logForEach(); message is only valid during the call.
+typedef void (*log_record_callback_t)(uint32_t sequence, const char *message, void *context);
+
 void eepromInit();
-void write_to_eeprom(const DeviceState *state);
+bool write_to_eeprom(const DeviceState *state);
 bool read_from_eeprom(DeviceState *state);
 void eepromWriteBytes(uint16_t address, const uint8_t *data, uint8_t length);
 void eepromWriteByte_NoDelay(uint16_t address, uint8_t data);
 void eepromWriteByte(uint16_t address, uint8_t data);
+bool eepromFill(uint16_t address, uint8_t value, uint16_t length);
 uint8_t eepromReadByte(uint16_t address);
+void eepromFlush();
+bool eepromSync();
+void eepromGetWriteStats(eeprom_write_stats *stats);
+void eepromGetCacheStats(eeprom_cache_stats *stats);
+void eepromGetBusStats(eeprom_bus_stats *stats);
 void eepromReadBytes(uint16_t address, uint8_t *data, uint8_t length);
-uint16_t crc16(const uint8_t *data, size_t length);
+void eepromReadStream(uint16_t address, uint16_t length, eeprom_consumer_t consume, void *context);
+bool positionWrite(int steps, bool exact);
+int positionRead();
+void logInit();
 void writeLogEntry(const char *message);
+int logForEach(log_record_callback_t callback, void *context);
 void printLog();
 void eraseLog();
 void printAllMemory();
 void eraseAll();
+bool factoryReset();
 
 #endif
@@ -0,0 +1,55 @@
+/*
+ * Decodes uplink payloads as shown by the network server, e.g. "18 02 05 02 00 03".
+ *
+ * Usage: decode_payload [HEX...]
+ *
+ * Without arguments the payloads are read from standard input, one per line. Spaces inside a payload are ignored.
+ * Prints one line per payload and exits with 1 if any of them could not be decoded.
+ */
+#include <ctype.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "payload.h"
+
+#define LINE_LEN 128
+
+static bool decode(const char *input) {
+    char hex[LINE_LEN];
+    size_t len = 0;
+    payload_event event;
+
+    for (; '\0' != *input && len < sizeof(hex) - 1; input++) {
+        if (!isspace((unsigned char) *input)) {
+            hex[len++] = *input;
+        }
+    }
+    hex[len] = '\0';
+    if (0 == len) {
+        return true;
+    }
+    if (!payloadDecodeHex(hex, &event)) {
+        printf("%s: not a version %d payload\n", hex, PAYLOAD_VERSION);
+        return false;
+    }
+    char text[LINE_LEN];
+    payloadFormat(&event, text, sizeof(text));
+    printf("%s: %s\n", hex, text);
+    return true;
+}
+
+int main(int argc, char **argv) {
+    bool ok = true;
+
+    if (argc > 1) {
+        for (int i = 1; i < argc; i++) {
+            ok = decode(argv[i]) && ok;
+        }
+    } else {
+        char line[LINE_LEN];
+        while (NULL != fgets(line, sizeof(line), stdin)) {
+            ok = decode(line) && ok;
+        }
+    }
+    return ok ? 0 : 1;
+}
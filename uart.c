@@ -58,26 +58,25 @@ void uart_setup(int uart_nr, int tx_pin, int rx_pin, int speed)
     irq_set_enabled(uart->irqn, true);
 }
 
+void uart_set_rx_callback(int uart_nr, uart_rx_callback_t callback)
+{
+    uart_t *u = uart_get_handle(uart_nr);
+    irq_set_enabled(u->irqn, false);
+    u->rx_callback = callback;
+    irq_set_enabled(u->irqn, true);
+}
+
 int uart_read(int uart_nr, uint8_t *buffer, int size)
 {
-    int count = 0;
     uart_t *u = uart_get_handle(uart_nr);
-    while(count < size && !rb_empty(&u->rx)) {
-        *buffer++ = rb_get(&u->rx);
-        ++count;
-    }
-    return count;
+    return (int) rb_get_span(&u->rx, buffer, size);
 }
 
 int uart_write(int uart_nr, const uint8_t *buffer, int size)
 {
-    int count = 0;
     uart_t *u = uart_get_handle(uart_nr);
-    // write data to ring buffer
-    while(count < size && !rb_full(&u->tx)) {
-        rb_put(&u->tx, *buffer++);
-        ++count;
-    }
+    // write data to ring buffer, whatever does not fit is counted as tx overflow
+    int count = (int) rb_put_span(&u->tx, buffer, size);
     // disable interrupts on NVIC while managing transmit interrupts
     irq_set_enabled(u->irqn, false);
 
@@ -105,8 +104,12 @@ void uart_irq_rx(uart_t *u)
 {
     while(uart_is_readable(u->uart)) {
         uint8_t c = uart_getc(u->uart);
-        // ignoring return value for now
-        rb_put(&u->rx, c);
+        if (u->rx_callback) {
+            u->rx_callback(c);
+        } else {
+            // bytes that do not fit are dropped and counted in the ring buffer's overflows
+            rb_put(&u->rx, c);
+        }
     }
 }
 
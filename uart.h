@@ -8,13 +8,18 @@ int uart_read(int uart_nr, uint8_t *buffer, int size);
 int uart_write(int uart_nr, const uint8_t *buffer, int size);
 int uart_send(int uart_nr, const char *str);
 
+// called from the UART interrupt for every received byte instead of storing it in the rx ring buffer
+typedef void (*uart_rx_callback_t)(uint8_t c);
+
 typedef struct {
     ring_buffer tx;
     ring_buffer rx;
     uart_inst_t *uart;
     int irqn;
     irq_handler_t handler;
+    uart_rx_callback_t rx_callback;
 } uart_t;
 uart_t *uart_get_handle(int uart_nr);
+void uart_set_rx_callback(int uart_nr, uart_rx_callback_t callback);
 
 #endif
\ No newline at end of file
@@ -3,7 +3,7 @@
 //
 #include "watchdog.h"
 //initialize watchdog
-void watchdog_init(uint32_t timeout_ms) {
+void watchdogInit(uint32_t timeout_ms) {
     watchdog_enable(timeout_ms,true);
 }
 //updates the watchdog
@@ -1,5 +1,10 @@
+#ifndef WATCHDOG_H
+#define WATCHDOG_H
+
 #include "pico.h"
 #include "hardware/watchdog.h"
 
-void watchdog_init(uint32_t timeout_ms);
-void watchdogFeed();
\ No newline at end of file
+void watchdogInit(uint32_t timeout_ms);
+void watchdogFeed();
+
+#endif
\ No newline at end of file